@@ -21,11 +21,16 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 
 #include "i18n.h"
 #include <libiptcdata/iptc-data.h>
 #include <libiptcdata/iptc-jpeg.h>
 
+/* Largest padding that fits in an APP13 section next to the Photoshop
+ * 3.0 identifier, rounded down to an even size */
+#define MAX_RESERVE	65518
+
 static char help_str[] = N_("\
 Examples:\n\
   iptc image.jpg       # display the IPTC metadata contained in image.jpg\n\
@@ -52,6 +57,14 @@ Options:\n\
   -q, --quiet          produce less verbose output\n\
   -b, --backup         backup any modified files\n\
       --no-sort        do not sort tags before saving\n\
+      --reserve=BYTES  leave room for the IPTC data to grow by BYTES when\n\
+                       rewriting a file, so later changes can be saved\n\
+                       in place\n\
+      --in-place       overwrite the IPTC data in the file itself when the\n\
+                       new data fits, instead of writing a new file and\n\
+                       renaming it.  Faster for large images, but if the\n\
+                       save is interrupted the image may be corrupted.\n\
+                       Ignored with --backup\n\
 \n\
 Informative output:\n\
   -l, --list           list the names of all known tags (i.e. Caption, etc.)\n\
@@ -363,15 +376,15 @@ new_operation (OpList * list, OpType op, IptcRecord record,
 }
 
 static int
-perform_one_op (IptcData * d, Operation * op, IptcDataSet * ds, char * filename)
+perform_one_op (IptcDataEdit * edit, Operation * op, IptcDataSet * ds, char * filename)
 {
 	if (op->op == OP_ADD || op->op == OP_MODIFY) {
 		IptcDataSet * ds_add;
 		ds_add = iptc_dataset_copy (op->ds);
 		if (ds)
-			iptc_data_add_dataset_before (d, ds, ds_add);
+			iptc_data_edit_add_before (edit, ds, ds_add);
 		else {
-			iptc_data_add_dataset (d, ds_add);
+			iptc_data_edit_add (edit, ds_add);
 			if (op->op == OP_MODIFY) {
 				fprintf (stderr, _("%s: Could not find dataset %d:%d, adding it\n"), filename, op->record, op->tag);
 			}
@@ -387,7 +400,7 @@ perform_one_op (IptcData * d, Operation * op, IptcDataSet * ds, char * filename)
 			return -1;
 		}
 		if (ds)
-			iptc_data_remove_dataset (d, ds);
+			iptc_data_edit_remove (edit, ds);
 	}
 	if (op->op == OP_PRINT) {
 		if (!ds) {
@@ -406,25 +419,32 @@ perform_one_op (IptcData * d, Operation * op, IptcDataSet * ds, char * filename)
 static int
 perform_operations (IptcData * d, OpList * list, char * filename)
 {
+	IptcDataEdit * edit;
 	int i, j, ret = -1;
 
 	if (!d || !list || list->count == 0)
 		return 0;
 
+	/* Changes are collected and applied to d in one go at the end */
+	edit = iptc_data_edit_begin (d);
+	if (!edit)
+		return -1;
+
 	for (i = 0; i < list->count; i++) {
 		Operation * op = list->ops + i;
 		IptcDataSet * ds = NULL;
 
 		if (op->record && op->num == -1) {
-			ds = iptc_data_get_dataset (d, op->record, op->tag);
+			ds = iptc_data_edit_get_next_dataset (edit, NULL,
+					op->record, op->tag);
 			if (!ds) {
 				fprintf(stderr, _("%s: Could not find dataset %d:%d\n"), filename, op->record, op->tag);
 			}
 			while (ds) {
 				IptcDataSet * next_ds;
-				next_ds = iptc_data_get_next_dataset (d, ds,
-						op->record, op->tag);
-				if (perform_one_op (d, op, ds, filename) == 0)
+				next_ds = iptc_data_edit_get_next_dataset (edit,
+						ds, op->record, op->tag);
+				if (perform_one_op (edit, op, ds, filename) == 0)
 					ret = 0;
 				iptc_dataset_unref (ds);
 				ds = next_ds;
@@ -432,23 +452,27 @@ perform_operations (IptcData * d, OpList * list, char * filename)
 		}
 		else {
 			if (op->record) {
-				ds = iptc_data_get_dataset (d, op->record, op->tag);
+				ds = iptc_data_edit_get_next_dataset (edit, NULL,
+						op->record, op->tag);
 				for (j = 0; j < op->num && ds; j++) {
-					if (!ds)
-						break;
+					IptcDataSet * next_ds;
+					next_ds = iptc_data_edit_get_next_dataset (edit,
+							ds, op->record, op->tag);
 					iptc_dataset_unref (ds);
-					ds = iptc_data_get_next_dataset (d, ds,
-							op->record, op->tag);
+					ds = next_ds;
 				}
 			}
 
-			if (perform_one_op (d, op, ds, filename) == 0)
+			if (perform_one_op (edit, op, ds, filename) == 0)
 				ret = 0;
 			if (ds)
 				iptc_dataset_unref (ds);
 		}
 	}
 
+	if (iptc_data_edit_commit (edit) < 0)
+		return -1;
+
 	return ret;
 }
 
@@ -462,7 +486,7 @@ free_operations (OpList * list)
 
 	for (i = 0; i < list->count; i++) {
 		Operation * op = list->ops + i;
-		if (op->op == OP_ADD) {
+		if (op->op == OP_ADD || op->op == OP_MODIFY) {
 			iptc_dataset_unref (op->ds);
 		}
 	}
@@ -471,50 +495,37 @@ free_operations (OpList * list)
 	list->count = 0;
 }
 
+/* Parses a tag identifier as accepted by iptc_tag_find_by_id(),
+ * optionally followed by ":N" or ":all" to select which of the
+ * datasets with that tag are affected */
 static int
 parse_tag_id (char * str, IptcRecord *r, IptcTag *t, int *num)
 {
+	char * id, * a, * end;
+	int ret = -1;
+
 	*num = 0;
-	if (isdigit (str[0])) {
-		char * a;
-		*r = strtoul (str, &a, 10);
-		if (a[0] != ':' || !isdigit (a[1]))
-			return -1;
-		*t = strtoul (a + 1, &a, 10);
-		if (*r < 1 || *r > 9 || *t < 0 || *t > 255)
-			return -1;
-		if (a[0] == '\0')
-			return 0;
-		if (a[0] != ':')
-			return -1;
-		if (!strcmp (a + 1, "all"))
+	if (iptc_tag_find_by_id (str, r, t) == 0)
+		return 0;
+
+	id = strdup (str);
+	if (!id)
+		return -1;
+	a = strrchr (id, ':');
+	if (a) {
+		*a++ = '\0';
+		if (!strcmp (a, "all")) {
 			*num = -1;
-		else if (isdigit (a[1]))
-			*num = strtoul (a + 1, NULL, 10);
-		else
-			return -1;
-	}
-	else {
-		char * name = strdup (str);
-		char * a;
-		if ((a = strchr (name, ':'))) {
-			if (!strcmp (a+1, "all"))
-				*num = -1;
-			else if (isdigit (a[1]))
-				*num = strtoul (a + 1, NULL, 10);
-			else {
-				free (name);
-				return -1;
-			}
-			*a = '\0';
+			ret = iptc_tag_find_by_id (id, r, t);
 		}
-		if (iptc_tag_find_by_name (name, r, t) < 0) {
-			free (name);
-			return -1;
+		else if (isdigit (a[0])) {
+			*num = strtoul (a, &end, 10);
+			if (*end == '\0')
+				ret = iptc_tag_find_by_id (id, r, t);
 		}
-		free (name);
 	}
-	return 0;
+	free (id);
+	return ret;
 }
 
 int
@@ -529,6 +540,7 @@ main (int argc, char ** argv)
 	unsigned char * buf;
 	unsigned char * outbuf;
 	int buflen = 256 * 256;
+	int outbuflen = 256 * 256;
 	IptcFormat format;
 	char c;
 	int modified = 0;
@@ -537,6 +549,8 @@ main (int argc, char ** argv)
 	int is_quiet = 0;
 	int do_backup = 0;
 	int no_sort = 0;
+	int reserve = 0;
+	int in_place = 0;
 	int add_tag = 0;
 	int modify_tag = 0;
 	OpList oplist = { 0, 0 };
@@ -547,6 +561,8 @@ main (int argc, char ** argv)
 		{ "quiet", no_argument, NULL, 'q' },
 		{ "backup", no_argument, NULL, 'b' },
 		{ "no-sort", no_argument, NULL, 's' },
+		{ "reserve", required_argument, NULL, 'R' },
+		{ "in-place", no_argument, NULL, 'I' },
 		{ "list", no_argument, NULL, 'l' },
 		{ "list-desc", required_argument, NULL, 'L' },
 		{ "add", required_argument, NULL, 'a' },
@@ -578,6 +594,25 @@ main (int argc, char ** argv)
 			case 's':
 				no_sort = 1;
 				break;
+			case 'R': {
+				char * end;
+				unsigned long n = strtoul (optarg, &end, 10);
+				if (end == optarg || *end || *optarg == '-' ||
+						n > MAX_RESERVE) {
+					fprintf(stderr, _("\"%s\" is not a valid amount of bytes to reserve (at most %d)\n"),
+							optarg, MAX_RESERVE);
+					return 1;
+				}
+				/* The padding resource needs at least 12
+				 * bytes, and has an even size */
+				if (n > 0 && n < 12)
+					n = 12;
+				reserve = (int) (n + (n & 1));
+				break;
+			}
+			case 'I':
+				in_place = 1;
+				break;
 			case 'l':
 				print_tag_list ();
 				return 0;
@@ -711,11 +746,11 @@ main (int argc, char ** argv)
 	}
 
 	buf = malloc (buflen);
-	outbuf = malloc (buflen);
+	outbuf = malloc (outbuflen);
 
 	for (i = optind; i < argc; i++) {
 		char * filename = argv[i];
-		FILE * infile, * outfile;
+		FILE * infile;
 		IptcData * d = NULL;
 		int ps3_len, iptc_off;
 		unsigned int iptc_len;
@@ -726,6 +761,21 @@ main (int argc, char ** argv)
 			continue;
 		}
 
+		/* Large headers are split across several APP13 sections,
+		 * so size the buffer from the file */
+		ps3_len = iptc_jpeg_get_ps3_size (infile);
+		if (ps3_len > buflen) {
+			unsigned char * newbuf = realloc (buf, ps3_len);
+			if (!newbuf) {
+				fprintf(stderr, _("Not enough memory to read %s\n"), filename);
+				fclose (infile);
+				continue;
+			}
+			buf = newbuf;
+			buflen = ps3_len;
+		}
+		rewind (infile);
+
 		ps3_len = iptc_jpeg_read_ps3 (infile, buf, buflen);
 		fclose (infile);
 		if (ps3_len < 0) {
@@ -791,7 +841,7 @@ main (int argc, char ** argv)
 			unsigned char * iptc_buf = NULL;
 			char tmpfile[strlen(filename)+8];
 			char bakfile[strlen(filename)+8];
-			int v;
+			int infd, outfd, v;
 			
 			if (iptc_data_save (d, &iptc_buf, &iptc_len) < 0) {
 				fprintf(stderr, "%s: %s\n", filename, _("Failed to generate IPTC bytestream"));
@@ -799,8 +849,22 @@ main (int argc, char ** argv)
 				
 				continue;
 			}
+			/* Room for the old header, the new IPTC data, the
+			 * resource header and any padding */
+			v = (ps3_len ? ps3_len : 14) + iptc_len + 13 + reserve;
+			if (v > outbuflen) {
+				unsigned char * newbuf = realloc (outbuf, v);
+				if (!newbuf) {
+					fprintf(stderr, "%s: %s\n", filename, _("Failed to generate PS3 header"));
+					iptc_data_free_buf (d, iptc_buf);
+					iptc_data_unref (d);
+					continue;
+				}
+				outbuf = newbuf;
+				outbuflen = v;
+			}
 			ps3_len = iptc_jpeg_ps3_save_iptc (buf, ps3_len,
-					iptc_buf, iptc_len, outbuf, buflen);
+					iptc_buf, iptc_len, outbuf, outbuflen);
 			iptc_data_free_buf (d, iptc_buf);
 			if (ps3_len < 0) {
 				fprintf(stderr, "%s: %s\n", filename, _("Failed to generate PS3 header"));
@@ -808,54 +872,85 @@ main (int argc, char ** argv)
 				continue;
 			}
 
-			infile = fopen (filename, "r");
-			if (!infile) {
-				fprintf(stderr, "%s: %s\n", filename, _("Failed to reopen file"));
-				iptc_data_unref (d);
-				continue;
-			}
-			sprintf(tmpfile, "%s.%d", filename, getpid());
-			outfile = fopen (tmpfile, "w");
-			if (!outfile) {
-				fprintf(stderr, "%s: %s\n", filename, _("Can't open temporary file for writing"));
-				fclose (infile);
-				iptc_data_unref (d);
-				continue;
+			/* Overwrite the old header if asked to and the new
+			 * one fits in it, unless the old file has to be kept
+			 * as a backup */
+			v = 0;
+			if (in_place && !do_backup) {
+				infile = fopen (filename, "r+b");
+				if (infile) {
+					v = iptc_jpeg_update_in_place (infile,
+							outbuf, ps3_len);
+					if (fclose (infile) != 0)
+						v = -1;
+				}
+				if (v > 0 && !is_quiet)
+					fprintf(stderr, _("%s: saved\n"), filename);
+				else if (v < 0)
+					fprintf(stderr, "%s: %s\n", filename, _("Failed to save image"));
 			}
+
+			if (v == 0) {
+				if (reserve > 0) {
+					v = iptc_jpeg_ps3_add_padding (outbuf, ps3_len,
+							outbuflen, reserve);
+					if (v > 0)
+						ps3_len = v;
+					else
+						fprintf(stderr, _("%s: Not enough room to reserve %d bytes, saving without padding\n"),
+								filename, reserve);
+				}
+
+				infd = open (filename, O_RDONLY);
+				if (infd < 0) {
+					fprintf(stderr, "%s: %s\n", filename, _("Failed to reopen file"));
+					iptc_data_unref (d);
+					continue;
+				}
+				sprintf(tmpfile, "%s.%d", filename, getpid());
+				outfd = open (tmpfile, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+				if (outfd < 0) {
+					fprintf(stderr, "%s: %s\n", filename, _("Can't open temporary file for writing"));
+					close (infd);
+					iptc_data_unref (d);
+					continue;
+				}
 			
-			v = iptc_jpeg_save_with_ps3 (infile, outfile, outbuf, ps3_len);
-			fclose (infile);
-			fclose (outfile);
-
-			if (v >= 0) {
-				struct stat statinfo;
-				if (do_backup) {
-					sprintf (bakfile, "%s~", filename);
-					unlink (bakfile);
-					if (link (filename, bakfile) < 0) {
-						fprintf (stderr, "%s: %s\n", filename, _("Failed to create backup file, aborting"));
+				v = iptc_jpeg_save_with_ps3_fd (infd, outfd, outbuf, ps3_len);
+				close (infd);
+				if (close (outfd) < 0)
+					v = -1;
+
+				if (v >= 0) {
+					struct stat statinfo;
+					if (do_backup) {
+						sprintf (bakfile, "%s~", filename);
+						unlink (bakfile);
+						if (link (filename, bakfile) < 0) {
+							fprintf (stderr, "%s: %s\n", filename, _("Failed to create backup file, aborting"));
+							unlink (tmpfile);
+							iptc_data_unref (d);
+							continue;
+						}
+					}
+					stat (filename, &statinfo);
+					if (rename (tmpfile, filename) < 0) {
+						fprintf(stderr, "%s: %s\n", filename, _("Failed to save image"));
 						unlink (tmpfile);
 						iptc_data_unref (d);
 						continue;
 					}
-				}
-				stat (filename, &statinfo);
-				if (rename (tmpfile, filename) < 0) {
-					fprintf(stderr, "%s: %s\n", filename, _("Failed to save image"));
-					unlink (tmpfile);
-					iptc_data_unref (d);
-					continue;
+					else {
+						chown (filename, -1, statinfo.st_gid);
+						chmod (filename, statinfo.st_mode);
+					}
+					if (!is_quiet)
+						fprintf(stderr, _("%s: saved\n"), filename);
 				}
 				else {
-					chown (filename, -1, statinfo.st_gid);
-					chmod (filename, statinfo.st_mode);
+					unlink (tmpfile);
+					fprintf(stderr, "%s: %s\n", filename, _("Failed to save image"));
 				}
-				if (!is_quiet)
-					fprintf(stderr, _("%s: saved\n"), filename);
-			}
-			else {
-				unlink (tmpfile);
-				fprintf(stderr, "%s: %s\n", filename, _("Failed to save image"));
 			}
 		}
 		
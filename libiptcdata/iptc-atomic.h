@@ -0,0 +1,97 @@
+/* iptc-atomic.h
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __IPTC_ATOMIC_H__
+#define __IPTC_ATOMIC_H__
+
+/* Atomic counters for the reference counts, so that objects can be
+ * shared between threads.  Not installed.
+ *
+ * iptc_atomic_inc() and iptc_atomic_dec() return the new value, and
+ * iptc_atomic_cas(a,old,desired) returns nonzero if *a was old and has
+ * been replaced by desired.  All operations are sequentially consistent. */
+
+#if defined(HAVE_STDATOMIC_H) && !defined(__STDC_NO_ATOMICS__)
+
+#include <stdatomic.h>
+
+typedef atomic_uint IptcAtomic;
+
+#define iptc_atomic_init(a,v)	atomic_init ((a), (v))
+#define iptc_atomic_get(a)	atomic_load ((a))
+#define iptc_atomic_set(a,v)	atomic_store ((a), (v))
+
+static inline unsigned int
+iptc_atomic_inc (IptcAtomic *a)
+{
+	return atomic_fetch_add (a, 1) + 1;
+}
+
+static inline unsigned int
+iptc_atomic_dec (IptcAtomic *a)
+{
+	return atomic_fetch_sub (a, 1) - 1;
+}
+
+static inline int
+iptc_atomic_cas (IptcAtomic *a, unsigned int old, unsigned int desired)
+{
+	return atomic_compare_exchange_strong (a, &old, desired);
+}
+
+#elif defined(HAVE_SYNC_BUILTINS)
+
+typedef volatile unsigned int IptcAtomic;
+
+#define iptc_atomic_init(a,v)	(*(a) = (v))
+#define iptc_atomic_get(a)	__sync_add_and_fetch ((a), 0)
+#define iptc_atomic_set(a,v)	((void) __sync_lock_test_and_set ((a), (v)), \
+				 __sync_synchronize ())
+#define iptc_atomic_inc(a)	__sync_add_and_fetch ((a), 1)
+#define iptc_atomic_dec(a)	__sync_sub_and_fetch ((a), 1)
+#define iptc_atomic_cas(a,o,n)	__sync_bool_compare_and_swap ((a), (o), (n))
+
+#elif defined(_WIN32)
+
+#include <windows.h>
+
+typedef volatile LONG IptcAtomic;
+
+#define iptc_atomic_init(a,v)	(*(a) = (v))
+#define iptc_atomic_get(a)	((unsigned int) InterlockedCompareExchange ((a), 0, 0))
+#define iptc_atomic_set(a,v)	((void) InterlockedExchange ((a), (v)))
+#define iptc_atomic_inc(a)	((unsigned int) InterlockedIncrement ((a)))
+#define iptc_atomic_dec(a)	((unsigned int) InterlockedDecrement ((a)))
+#define iptc_atomic_cas(a,o,n)	(InterlockedCompareExchange ((a), (n), (o)) == (LONG) (o))
+
+#else
+
+/* No atomic operations known for this platform: objects must not be
+ * shared between threads. */
+typedef unsigned int IptcAtomic;
+
+#define iptc_atomic_init(a,v)	(*(a) = (v))
+#define iptc_atomic_get(a)	(*(a))
+#define iptc_atomic_set(a,v)	(*(a) = (v))
+#define iptc_atomic_inc(a)	(++*(a))
+#define iptc_atomic_dec(a)	(--*(a))
+#define iptc_atomic_cas(a,o,n)	(*(a) == (o) ? (*(a) = (n), 1) : 0)
+
+#endif
+
+#endif /* __IPTC_ATOMIC_H__ */
@@ -21,21 +21,79 @@
 #include "config.h"
 #include "iptc-data.h"
 #include "iptc-jpeg.h"
+#include "iptc-private.h"
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 
+/* A dataset passed over by iptc_data_load_filtered(), header included,
+ * in the buffer that was loaded */
+typedef struct {
+	const unsigned char *buf;
+	unsigned int size;
+	IptcBorrow *borrow;	/* Reference on that buffer, if tracked */
+} IptcDataSkipped;
+
 struct _IptcDataPrivate
 {
-	unsigned int ref_count;
+	IptcAtomic ref_count;
+
+	/* Number of slots allocated in the datasets array */
+	unsigned int capacity;
+
+	/* First dataset for each record:tag, one table of 256 tags per
+	 * record, allocated when first needed.  The other datasets with
+	 * the same record:tag are chained through their private next
+	 * pointers.  Rebuilt as soon as the datasets are reordered, so
+	 * that lookups never modify the collection; index_valid is only
+	 * cleared if that fails, and lookups then scan the array. */
+	IptcDataSet **index[9];
+	int index_valid;
+
+	/* Set while the datasets are known to be in the order
+	 * iptc_data_sort() would put them in.  Kept up to date along with
+	 * the index. */
+	int sorted;
+
+	/* Datasets kept by IPTC_LOAD_KEEP_SKIPPED, in stream order */
+	IptcDataSkipped *skipped;
+	unsigned int n_skipped;
+
+	/* Frozen collection that the skipped spans of a clone point into,
+	 * referenced for as long as they do */
+	IptcData *keep;
+
+	/* Set while the datasets loaded by iptc_data_load_lazy() are
+	 * only known by their headers.  The datasets array is empty
+	 * until iptc_data_materialize() moves them into it.  The headers
+	 * are kept as parallel arrays in a single allocation starting at
+	 * lazy_ds, so that searches only go through the 2 byte keys. */
+	const unsigned char *lazy_buf;
+	IptcBorrow *lazy_borrow;	/* Reference on lazy_buf, if tracked */
+	unsigned int n_lazy;
+	IptcDataSet **lazy_ds;		/* Created on demand, owned here */
+	unsigned int *lazy_offset;	/* Of the payload in lazy_buf */
+	unsigned int *lazy_size;
+	unsigned short *lazy_key;	/* record << 8 | tag */
 
 	IptcLog *log;
 	IptcMem *mem;
+
+	/* Set on the copies made by iptc_data_freeze(), which are never
+	 * modified and share a single allocation with their datasets */
+	int frozen;
+
+	/* Open batch of changes, during which datasets can only be added
+	 * or removed through it */
+	IptcDataEdit *edit;
 };
 
 #define IPTC_TAG_MARKER		0x1c
 
+static int iptc_data_materialize (IptcData *data);
+static void iptc_data_edit_retagged (IptcDataEdit *edit, IptcDataSet *ds);
+
 /**
  * iptc_data_new:
  *
@@ -78,17 +136,16 @@ iptc_data_new_mem (IptcMem *mem)
 
 	if (!mem) return NULL;
 
-	data = iptc_mem_alloc (mem, (IptcLong) sizeof (IptcData));
+	/* The private part shares the allocation of the public struct */
+	data = iptc_mem_alloc (mem, (IptcLong) (sizeof (IptcData) +
+				sizeof (IptcDataPrivate)));
 	if (!data)
 		return NULL;
-	data->priv = iptc_mem_alloc (mem,
-				(IptcLong) sizeof (IptcDataPrivate));
-	if (!data->priv) {
-		iptc_mem_free (mem, data);
-		return NULL;
-	}
+	data->priv = (IptcDataPrivate *) (data + 1);
 
-	data->priv->ref_count = 1;
+	iptc_atomic_init (&data->priv->ref_count, 1);
+	data->priv->index_valid = 1;
+	data->priv->sorted = 1;
 
 	data->priv->mem = mem;
 	iptc_mem_ref (mem);
@@ -120,91 +177,230 @@ iptc_data_new_from_data (const unsigned char *buf, unsigned int size)
 	return (idata);
 }
 
+/* Decodes the header of the dataset at the start of @d.  On success the
+ * payload length is stored in @len and the offset of the payload from
+ * @d is returned; -1 is returned if @d does not hold a complete
+ * dataset. */
 static int
-iptc_data_load_dataset (IptcData *data, IptcDataSet *dataset,
-			   const unsigned char *d,
-			   unsigned int size)
+iptc_data_parse_header (const unsigned char *d, unsigned int size,
+			unsigned int *len)
 {
-	unsigned int doff, count;
-
-	if (d[0] != IPTC_TAG_MARKER)
-		return -1;
+	unsigned int i, doff = 5, l;
 
-	if (size < 5)
+	if (size < 5 || d[0] != IPTC_TAG_MARKER)
 		return -1;
 
-	iptc_dataset_set_tag (dataset, d[1], d[2]);
-	count = iptc_get_short (d + 3, IPTC_BYTE_ORDER_MOTOROLA);
-
-	iptc_log (data->priv->log, IPTC_LOG_CODE_DEBUG, "IptcData",
-		  "Loading dataset %d:%d ('%s')...", dataset->record, dataset->tag,
-		  iptc_tag_get_name (dataset->record, dataset->tag));
-
-	doff = 5;
-	if (count & (1 << 15)) {
-		unsigned int i;
-		dataset->size = 0;
-		count &= ~(1 << 15);
-		if (size < count + doff)
+	l = iptc_get_short (d + 3, IPTC_BYTE_ORDER_MOTOROLA);
+	if (l & (1 << 15)) {
+		unsigned int count = l & ~(1 << 15);
+		if (size - doff < count)
 			return -1;
-		for (i=0; i < count; i++) {
-			dataset->size = (dataset->size << 8) | d[doff+i];
-		}
+		for (i = 0, l = 0; i < count; i++)
+			l = (l << 8) | d[doff+i];
 		doff += count;
-		if (count > 4) {
-			iptc_log (data->priv->log, IPTC_LOG_CODE_CORRUPT_DATA,
-				"iptcData", "Field length has size %d bytes",
-				count);
-		}
 	}
-	else {
-		dataset->size = count;
-	}
-
-	if (size < doff + dataset->size)
+	if (size - doff < l)
 		return -1;
 
-	iptc_dataset_set_data (dataset, d+doff, dataset->size, IPTC_DONT_VALIDATE);
+	*len = l;
+	return doff;
+}
 
-	return doff + dataset->size;
+/* Same as iptc_data_parse_header() for a dataset that
+ * iptc_data_scan() has already found to be complete */
+static unsigned int
+iptc_data_header_size (const unsigned char *d, unsigned int *len)
+{
+	unsigned int i, doff = 5, l;
+
+	l = iptc_get_short (d + 3, IPTC_BYTE_ORDER_MOTOROLA);
+	if (l & (1 << 15)) {
+		unsigned int count = l & ~(1 << 15);
+		for (i = 0, l = 0; i < count; i++)
+			l = (l << 8) | d[doff+i];
+		doff += count;
+	}
+
+	*len = l;
+	return doff;
 }
 
-static int
-iptc_data_save_dataset (IptcData *data, IptcDataSet *e,
-			   unsigned char **d, unsigned int *ds)
+/* Loads the dataset at @d, which iptc_data_scan() has already found to
+ * be complete, and returns its length */
+static unsigned int
+iptc_data_load_dataset (IptcData *data, IptcDataSet *dataset,
+			   const unsigned char *d, int borrow, IptcBorrow *owner)
 {
-	unsigned int doff, s;
-	unsigned char * buf;
+	unsigned int doff, len;
 
-	if (!data || !data->priv) return -1;
+	doff = iptc_data_header_size (d, &len);
 
-	if (e->size >= (1 << 15))
-		doff = 9;
-	else
-		doff = 5;
-	s = doff + e->size;
+	iptc_dataset_set_tag (dataset, d[1], d[2]);
 
-	*d = iptc_mem_realloc (data->priv->mem, *d, *ds + s);
-	if (!*d) {
-		IPTC_LOG_NO_MEMORY (data->priv->log, "IptcData", *ds);
-		return -1;
+	if (iptc_log_enabled (data->priv->log, IPTC_LOG_CODE_DEBUG))
+		iptc_log (data->priv->log, IPTC_LOG_CODE_DEBUG, "IptcData",
+			  "Loading dataset %d:%d ('%s')...", dataset->record,
+			  dataset->tag,
+			  iptc_tag_get_name (dataset->record, dataset->tag));
+
+	if (doff > 9) {
+		iptc_log (data->priv->log, IPTC_LOG_CODE_CORRUPT_DATA,
+			"iptcData", "Field length has size %d bytes",
+			doff - 5);
 	}
-	buf = *d + *ds;
-	*ds += s;
+
+	dataset->size = len;
+	if (borrow)
+		iptc_dataset_set_data_borrowed (dataset, d+doff, len, owner);
+	else
+		iptc_dataset_set_data (dataset, d+doff, len,
+				IPTC_DONT_VALIDATE);
+
+	return doff + len;
+}
+
+#define IPTC_DATASET_HEADER_SIZE(e)	((e)->size >= (1 << 15) ? 9 : 5)
+
+static unsigned int
+iptc_data_save_dataset (IptcDataSet *e, unsigned char *buf)
+{
+	unsigned int doff = IPTC_DATASET_HEADER_SIZE (e);
 
 	buf[0] = IPTC_TAG_MARKER;
 	buf[1] = e->record;
 	buf[2] = e->tag;
-	if (e->size >= (1 << 15)) {
+	if (doff == 9) {
 		iptc_set_short (buf+3, IPTC_BYTE_ORDER_MOTOROLA, (1 << 15) | 4);
 		iptc_set_long (buf+5, IPTC_BYTE_ORDER_MOTOROLA, e->size);
 	}
 	else {
 		iptc_set_short (buf+3, IPTC_BYTE_ORDER_MOTOROLA, e->size);
 	}
-	
-	/* Write the data. Fill unneeded bytes with 0. */
-	memcpy (buf + doff, e->data, e->size);
+
+	if (e->size)
+		memcpy (buf + doff, e->data, e->size);
+	return doff + e->size;
+}
+
+/* Walks the chain of dataset headers in @buf without decoding anything,
+ * up to the first byte that does not start a complete dataset.  The
+ * datasets selected by @filter are counted in @n and the others in
+ * @skipped, and the total size of their payloads is stored in @payload.
+ * Returns the number of bytes taken by the complete datasets; if this
+ * is followed by a dataset marker, the dataset there is truncated or
+ * corrupt.  Each length depends on the header before it, so there is
+ * nothing to gain from looking at more than one header at a time. */
+static unsigned int
+iptc_data_scan (const unsigned char *buf, unsigned int size,
+		const IptcTagFilter *filter, unsigned int *n,
+		unsigned int *skipped, unsigned int *payload)
+{
+	unsigned int off = 0;
+
+	*n = *skipped = *payload = 0;
+
+	for (;;) {
+		unsigned int len;
+		int doff = iptc_data_parse_header (buf + off, size - off, &len);
+		if (doff < 0)
+			break;
+
+		if (!filter || iptc_tag_filter_contains (filter, buf[off+1],
+					buf[off+2]))
+			(*n)++;
+		else
+			(*skipped)++;
+		*payload += len;
+		off += doff + len;
+	}
+
+	return off;
+}
+
+#define IPTC_SCAN_CORRUPT(buf,size,end) \
+	((end) < (size) && (buf)[end] == IPTC_TAG_MARKER)
+
+static int
+iptc_data_load_real (IptcData *data, const unsigned char *buf,
+		     unsigned int size, const IptcTagFilter *filter,
+		     IptcLoadFlags flags, IptcBorrow *owner)
+{
+	unsigned int n, n_skipped, payload, end, off, s;
+
+	if (!data || !data->priv || data->priv->frozen || data->priv->edit ||
+			!buf || !size)
+		return -1;
+	if (iptc_data_materialize (data) < 0)
+		return -1;
+
+	if (iptc_log_enabled (data->priv->log, IPTC_LOG_CODE_DEBUG))
+		iptc_log (data->priv->log, IPTC_LOG_CODE_DEBUG, "IptcData",
+			  "Parsing %i byte(s) IPTC data...\n", size);
+
+	/* Find the complete datasets first, so that the loop below
+	 * needs no bounds checks and never has to back out of a
+	 * dataset it has started to add */
+	end = iptc_data_scan (buf, size, filter, &n, &n_skipped, &payload);
+	if (iptc_data_reserve (data, data->count + n) < 0)
+		return -1;
+	if (!(flags & IPTC_LOAD_KEEP_SKIPPED))
+		n_skipped = 0;
+	if (n_skipped) {
+		IptcDataSkipped *skipped;
+
+		skipped = iptc_mem_realloc (data->priv->mem,
+				data->priv->skipped,
+				sizeof (IptcDataSkipped) *
+				(data->priv->n_skipped + n_skipped));
+		if (!skipped) {
+			IPTC_LOG_NO_MEMORY (data->priv->log, "IptcData",
+				(int) (sizeof (IptcDataSkipped) *
+				(data->priv->n_skipped + n_skipped)));
+			return -1;
+		}
+		data->priv->skipped = skipped;
+	}
+
+	for (off = 0; off < end; off += s) {
+		const unsigned char *d = buf + off;
+		IptcDataSet *dataset;
+
+		if (filter && !iptc_tag_filter_contains (filter, d[1], d[2])) {
+			unsigned int len;
+
+			/* Pass over the dataset without touching its payload */
+			s = iptc_data_header_size (d, &len) + len;
+			if (n_skipped) {
+				IptcDataSkipped *k = data->priv->skipped +
+					data->priv->n_skipped++;
+				k->buf = d;
+				k->size = s;
+				k->borrow = owner;
+				iptc_borrow_ref (owner);
+			}
+			continue;
+		}
+
+		/* Loaded before it is added, so that setting its tag does
+		 * not have to reindex the collection */
+		dataset = iptc_dataset_new_mem (data->priv->mem);
+		if (!dataset)
+			return -1;
+		s = iptc_data_load_dataset (data, dataset, d,
+				flags & IPTC_LOAD_BORROW, owner);
+		if (iptc_data_add_dataset (data, dataset) < 0) {
+			iptc_dataset_unref (dataset);
+			return -1;
+		}
+		iptc_dataset_unref (dataset);
+	}
+
+	if (IPTC_SCAN_CORRUPT (buf, size, end)) {
+		iptc_log (data->priv->log, IPTC_LOG_CODE_CORRUPT_DATA,
+			"IptcData", "Truncated dataset at offset %u", end);
+		return -1;
+	}
+
 	return 0;
 }
 
@@ -224,36 +420,324 @@ int
 iptc_data_load (IptcData *data, const unsigned char *buf,
 		     unsigned int size)
 {
-	if (!data || !data->priv || !buf || !size) return -1;
+	return iptc_data_load_real (data, buf, size, NULL, 0, NULL);
+}
+
+/* Starts tracking @buf on behalf of @data if @destroy is set.  Returns
+ * 0 and sets *borrow, or calls @destroy and returns -1 on failure. */
+static int
+iptc_data_borrow (IptcData *data, IptcDestroyFunc destroy, void *user_data,
+		IptcBorrow **borrow)
+{
+	*borrow = NULL;
+	if (!destroy)
+		return 0;
+
+	if (data && data->priv)
+		*borrow = iptc_borrow_new (data->priv->mem, destroy,
+				user_data);
+	if (!*borrow) {
+		destroy (user_data);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * iptc_data_load_borrowed:
+ * @data: object to be populated with the loaded datasets
+ * @buf: data buffer to be parsed, containing IPTC data
+ * @size: length of data buffer to be parsed
+ *
+ * @destroy: function called once nothing refers to @buf anymore, or NULL
+ * @user_data: argument passed to @destroy
+ *
+ * Same as iptc_data_load(), except that the payload of each loaded
+ * dataset is not copied: the data member of every new #IptcDataSet
+ * points directly into @buf.  This avoids one allocation and one copy
+ * per dataset, which matters when the data is only going to be read.
+ * A dataset stops referencing @buf as soon as it is given a new value
+ * with iptc_dataset_set_data() or a related function, at which point
+ * it owns a private copy like any other dataset.  The contents of a
+ * borrowed payload must not be modified in place through the
+ * dataset's data pointer.
+ *
+ * @buf must stay valid and unmodified for as long as a dataset borrows
+ * from it, including datasets the application keeps after releasing
+ * @data and those shared with a clone.  Each of them holds a reference
+ * on @buf, and @destroy is called with @user_data when the last one is
+ * released, so that @buf can be freed there.  This may happen before
+ * this function returns, for example if nothing was loaded or on
+ * failure.  With a NULL @destroy, the application has to keep @buf
+ * alive itself until @data and every dataset obtained from it have
+ * been released, which suits static buffers.
+ *
+ * Returns: 0 on success, -1 on failure.  Note that in the failure
+ * case, some datasets may still have been added to @data.
+ */
+int
+iptc_data_load_borrowed (IptcData *data, const unsigned char *buf,
+		     unsigned int size, IptcDestroyFunc destroy,
+		     void *user_data)
+{
+	IptcBorrow *borrow;
+	int ret;
+
+	if (iptc_data_borrow (data, destroy, user_data, &borrow) < 0)
+		return -1;
+	ret = iptc_data_load_real (data, buf, size, NULL, IPTC_LOAD_BORROW,
+			borrow);
+	iptc_borrow_unref (borrow);
+	return ret;
+}
+
+/**
+ * iptc_data_load_filtered:
+ * @data: object to be populated with the loaded datasets
+ * @buf: data buffer to be parsed, containing IPTC data
+ * @size: length of data buffer to be parsed
+ * @filter: the record:tag combinations to load, or NULL to load all
+ * @flags: options controlling how datasets are loaded
+ * @destroy: function called once nothing refers to @buf anymore, or NULL
+ * @user_data: argument passed to @destroy
+ *
+ * Same as iptc_data_load(), except that only the datasets selected by
+ * @filter are added to @data.  The other datasets are passed over by
+ * reading their headers alone: no #IptcDataSet is created for them and
+ * their payload is neither allocated nor copied.  This makes it cheap
+ * to read a few text fields from a block that also carries a large
+ * preview image or object data.
+ *
+ * If @flags includes %IPTC_LOAD_BORROW, the selected datasets borrow
+ * their payload from @buf as described for iptc_data_load_borrowed(),
+ * which also explains @destroy and @user_data.
+ *
+ * If @flags includes %IPTC_LOAD_KEEP_SKIPPED, the location of each
+ * dataset that was passed over is remembered, and iptc_data_save() and
+ * related functions write those datasets back verbatim.  They are
+ * merged with the datasets of @data by record and tag number, before
+ * any dataset of @data with the same or a higher record:tag, which
+ * preserves their position as long as @data is sorted.  In this mode
+ * @buf must stay valid and unmodified until @data is freed or
+ * iptc_data_discard_skipped() is called, and @data holds a reference
+ * on @buf until then.
+ *
+ * Returns: 0 on success, -1 on failure.  Note that in the failure
+ * case, some datasets may still have been added to @data.
+ */
+int
+iptc_data_load_filtered (IptcData *data, const unsigned char *buf,
+		unsigned int size, const IptcTagFilter *filter,
+		IptcLoadFlags flags, IptcDestroyFunc destroy, void *user_data)
+{
+	IptcBorrow *borrow;
+	int ret;
 
-	iptc_log (data->priv->log, IPTC_LOG_CODE_DEBUG, "IptcData",
-		  "Parsing %i byte(s) IPTC data...\n", size);
+	if (iptc_data_borrow (data, destroy, user_data, &borrow) < 0)
+		return -1;
+	ret = iptc_data_load_real (data, buf, size, filter, flags, borrow);
+	iptc_borrow_unref (borrow);
+	return ret;
+}
+
+/**
+ * iptc_data_discard_skipped:
+ * @data: collection of datasets
+ *
+ * Forgets any datasets that were passed over but kept by
+ * iptc_data_load_filtered() with %IPTC_LOAD_KEEP_SKIPPED, so that
+ * they are no longer saved and the buffer they were loaded from may
+ * be released.
+ */
+void
+iptc_data_discard_skipped (IptcData *data)
+{
+	unsigned int i;
+
+	if (!data || !data->priv || data->priv->frozen)
+		return;
+
+	for (i = 0; i < data->priv->n_skipped; i++)
+		iptc_borrow_unref (data->priv->skipped[i].borrow);
+	iptc_mem_free (data->priv->mem, data->priv->skipped);
+	data->priv->skipped = NULL;
+	data->priv->n_skipped = 0;
+	iptc_data_unref (data->priv->keep);
+	data->priv->keep = NULL;
+}
+
+/**
+ * iptc_scan_stream:
+ * @buf: data buffer to be checked, containing IPTC data
+ * @size: length of data buffer to be checked
+ * @count: output parameter for the number of complete datasets, or NULL
+ * @payload: output parameter for the total size in bytes of their
+ * payloads, or NULL
+ *
+ * Checks the structure of a buffer containing raw IPTC data by
+ * following the chain of dataset headers, without decoding or
+ * allocating anything.  This is the same pass that iptc_data_load()
+ * makes before adding any datasets, and it can be used to reject a
+ * corrupt block or size an #IptcMem arena in advance.  Like
+ * iptc_data_load(), it stops quietly at the first byte that does not
+ * start a dataset, so trailing padding is not an error.
+ *
+ * Returns: 0 if every dataset in @buf is complete, or -1 if @buf
+ * contains a truncated or corrupt dataset.  In both cases @count and
+ * @payload describe the complete datasets that precede the point where
+ * the scan stopped, which are the ones iptc_data_load() would add.
+ */
+int
+iptc_scan_stream (const unsigned char *buf, unsigned int size,
+		unsigned int *count, unsigned int *payload)
+{
+	unsigned int n, skipped, p, end;
+
+	if (!buf) return -1;
+
+	end = iptc_data_scan (buf, size, NULL, &n, &skipped, &p);
+	if (count)
+		*count = n;
+	if (payload)
+		*payload = p;
+
+	return IPTC_SCAN_CORRUPT (buf, size, end) ? -1 : 0;
+}
+
+/**
+ * iptc_parse_stream:
+ * @buf: data buffer to be parsed, containing IPTC data
+ * @size: length of data buffer to be parsed
+ * @func: function to be called for each dataset found
+ * @user_data: arbitrary user data to be passed to @func
+ *
+ * Walks a buffer containing raw IPTC data and calls @func once for
+ * each dataset, in stream order, with its record, tag, and a pointer
+ * to its payload within @buf.  No #IptcData or #IptcDataSet objects
+ * are created and nothing is allocated or copied, so this is the
+ * cheapest way to extract a few values from a block that is only
+ * going to be read once.  The payload pointer is only valid for as
+ * long as @buf is.  If @func returns a nonzero value, parsing stops
+ * immediately.
+ *
+ * Returns: 0 if the whole buffer was parsed, 1 if parsing was stopped
+ * by @func, or -1 if @buf contains a truncated or corrupt dataset.
+ * In the failure case, @func may already have been called for the
+ * datasets preceding the corrupt one.
+ */
+int
+iptc_parse_stream (const unsigned char *buf, unsigned int size,
+		IptcParseFunc func, void *user_data)
+{
+	if (!buf || !func) return -1;
 
 	while (size > 0 && buf[0] == IPTC_TAG_MARKER) {
-		IptcDataSet *dataset;
-		int s;
+		unsigned int len;
+		int doff;
 
-		dataset = iptc_dataset_new_mem (data->priv->mem);
-		if (!dataset)
+		doff = iptc_data_parse_header (buf, size, &len);
+		if (doff < 0)
 			return -1;
-		if (iptc_data_add_dataset (data, dataset) < 0) {
-			iptc_dataset_unref (dataset);
-			return -1;
-		}
-		s = iptc_data_load_dataset (data, dataset, buf, size);
-		if (s < 0) {
-			iptc_data_remove_dataset (data, dataset);
-			iptc_dataset_unref (dataset);
-			return -1;
-		}
-		buf += s;
-		size -= s;
-		iptc_dataset_unref (dataset);
+		if (func (buf[1], buf[2], buf + doff, len, user_data))
+			return 1;
+
+		buf += doff + len;
+		size -= doff + len;
 	}
 
 	return 0;
 }
 
+/**
+ * iptc_data_get_serialized_size:
+ * @data: collection of datasets
+ *
+ * Computes the exact number of bytes that iptc_data_save() or
+ * iptc_data_save_to_buffer() will produce for @data in its current
+ * state.
+ *
+ * Returns: the size of the IPTC bytestream in bytes, 0 if @data is
+ * empty or NULL
+ */
+unsigned int
+iptc_data_get_serialized_size (IptcData *data)
+{
+	unsigned int j, size = 0;
+
+	if (!data || iptc_data_materialize (data) < 0)
+		return 0;
+
+	for (j = 0; j < data->count; j++)
+		size += IPTC_DATASET_HEADER_SIZE (data->datasets[j]) +
+			data->datasets[j]->size;
+	if (data->priv)
+		for (j = 0; j < data->priv->n_skipped; j++)
+			size += data->priv->skipped[j].size;
+
+	return size;
+}
+
+/**
+ * iptc_data_save_to_buffer:
+ * @data: collection of datasets to be saved
+ * @buf: output buffer supplied by the application
+ * @size: size in bytes of @buf
+ *
+ * Outputs a collection of datasets as an IPTC bytestream into memory
+ * owned by the application, without allocating anything.  The number
+ * of bytes needed can be obtained in advance with
+ * iptc_data_get_serialized_size().  The object @data is unmodified by
+ * this function.
+ *
+ * Returns: the number of bytes written to @buf, or -1 if @buf is too
+ * small or another error occurred.  Nothing is written in the failure
+ * case.
+ */
+int
+iptc_data_save_to_buffer (IptcData *data, unsigned char *buf,
+		unsigned int size)
+{
+	const IptcDataSkipped *k;
+	unsigned int j, len, n;
+
+	if (!data || !data->priv || (!buf && size))
+		return -1;
+	if (iptc_data_materialize (data) < 0)
+		return -1;
+
+	len = iptc_data_get_serialized_size (data);
+	if (len > size)
+		return -1;
+
+	if (iptc_log_enabled (data->priv->log, IPTC_LOG_CODE_DEBUG))
+		iptc_log (data->priv->log, IPTC_LOG_CODE_DEBUG, "IptcData",
+			  "Saving %i datasets...", data->count);
+	k = data->priv->skipped;
+	n = data->priv->n_skipped;
+	for (j = 0, len = 0; j < data->count; j++) {
+		IptcDataSet *e = data->datasets[j];
+
+		/* Write back any skipped datasets that belong first */
+		for (; n && (k->buf[1] < e->record ||
+			     (k->buf[1] == e->record && k->buf[2] <= e->tag));
+				k++, n--) {
+			memcpy (buf + len, k->buf, k->size);
+			len += k->size;
+		}
+		len += iptc_data_save_dataset (e, buf + len);
+	}
+	for (; n; k++, n--) {
+		memcpy (buf + len, k->buf, k->size);
+		len += k->size;
+	}
+
+	if (iptc_log_enabled (data->priv->log, IPTC_LOG_CODE_DEBUG))
+		iptc_log (data->priv->log, IPTC_LOG_CODE_DEBUG, "IptcData",
+			  "Saved %i byte(s) IPTC data.", len);
+
+	return len;
+}
+
 /**
  * iptc_data_save:
  * @data: collection of datasets to be saved
@@ -265,7 +749,8 @@ iptc_data_load (IptcData *data, const unsigned char *buf,
  * to the address of the output buffer by this function.  @size will contain
  * this buffer's length after completion.  The object @data is unmodified by this
  * function.  The application should free the output buffer using
- * iptc_data_free_buf() when it is no longer needed.
+ * iptc_data_free_buf() when it is no longer needed.  To write into a buffer
+ * owned by the application instead, use iptc_data_save_to_buffer().
  *
  * Returns: 0 on success, -1 on failure.  In the failure case, @buf should still
  * be checked for a non-NULL value, and freed using iptc_data_free_buf() if
@@ -274,23 +759,27 @@ iptc_data_load (IptcData *data, const unsigned char *buf,
 int
 iptc_data_save (IptcData *data, unsigned char **buf, unsigned int *size)
 {
-	unsigned int j;
+	unsigned int len;
 
-	if (!data || !buf || !size)
+	if (!data || !data->priv || !buf || !size)
 		return -1;
 
 	*size = 0;
 	*buf = NULL;
 
-	/* Save each dataset */
-	iptc_log (data->priv->log, IPTC_LOG_CODE_DEBUG, "IptcData",
-		  "Saving %i datasets...", data->count);
-	for (j = 0; j < data->count; j++)
-		if (iptc_data_save_dataset (data, data->datasets[j], buf, size) < 0)
-			return -1;
+	len = iptc_data_get_serialized_size (data);
+	if (!len)
+		return 0;
 
-	iptc_log (data->priv->log, IPTC_LOG_CODE_DEBUG, "IptcData",
-		  "Saved %i byte(s) IPTC data.", *size);
+	*buf = iptc_mem_alloc (data->priv->mem, len);
+	if (!*buf) {
+		IPTC_LOG_NO_MEMORY (data->priv->log, "IptcData", len);
+		return -1;
+	}
+
+	if (iptc_data_save_to_buffer (data, *buf, len) < 0)
+		return -1;
+	*size = len;
 
 	return 0;
 }
@@ -317,7 +806,7 @@ iptc_data_new_from_jpeg (const char *path)
 	IptcData *d;
 	FILE * infile;
 	unsigned char * buf;
-	int buf_len = 256*256;
+	int buf_len;
 	int len, offset;
         unsigned int iptc_len;
 
@@ -325,6 +814,12 @@ iptc_data_new_from_jpeg (const char *path)
 	if (!infile)
 		return NULL;
 
+	buf_len = iptc_jpeg_get_ps3_size (infile);
+	if (buf_len <= 0 || fseek (infile, 0, SEEK_SET) < 0) {
+		fclose (infile);
+		return NULL;
+	}
+
 	d = iptc_data_new ();
 	if (!d) {
 		fclose (infile);
@@ -373,7 +868,9 @@ failure:
 void
 iptc_data_ref (IptcData *data)
 {
-	data->priv->ref_count++;
+	if (!data) return;
+
+	iptc_atomic_inc (&data->priv->ref_count);
 }
 
 /**
@@ -389,8 +886,9 @@ iptc_data_ref (IptcData *data)
 void
 iptc_data_unref (IptcData *data)
 {
-	data->priv->ref_count--;
-	if (!data->priv->ref_count)
+	if (!data) return;
+
+	if (!iptc_atomic_dec (&data->priv->ref_count))
 		iptc_data_free (data);
 }
 
@@ -412,12 +910,33 @@ iptc_data_free (IptcData *data)
 
 	if (!data) return;
 
+	if (data->priv && data->priv->frozen) {
+		/* The datasets and their contents are part of the same
+		 * allocation */
+		IptcMem *mem = data->priv->mem;
+		iptc_log_unref (data->priv->log);
+		iptc_mem_free (mem, data);
+		iptc_mem_unref (mem);
+		return;
+	}
+
 	for (i = 0; i < data->count; i++)
 		iptc_dataset_unref (data->datasets[i]);
 	if (data->priv) {
 		IptcMem *mem = data->priv->mem;
+		iptc_log_unref (data->priv->log);
+		for (i = 0; i < data->priv->n_lazy; i++)
+			if (data->priv->lazy_ds[i])
+				iptc_dataset_unref (data->priv->lazy_ds[i]);
+		iptc_mem_free (mem, data->priv->lazy_ds);
+		iptc_borrow_unref (data->priv->lazy_borrow);
+		for (i = 0; i < 9; i++)
+			iptc_mem_free (mem, data->priv->index[i]);
+		for (i = 0; i < data->priv->n_skipped; i++)
+			iptc_borrow_unref (data->priv->skipped[i].borrow);
+		iptc_mem_free (mem, data->priv->skipped);
+		iptc_data_unref (data->priv->keep);
 		iptc_mem_free (mem, data->datasets);
-		iptc_mem_free (mem, data->priv);
 		iptc_mem_free (mem, data);
 		iptc_mem_unref (mem);
 	}
@@ -440,6 +959,171 @@ iptc_data_free_buf (IptcData *data, unsigned char *buf)
 	iptc_mem_free (data->priv->mem, buf);
 }
 
+static int
+iptc_digits (const unsigned char *d, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+		if (d[i] < '0' || d[i] > '9')
+			return 0;
+	return 1;
+}
+
+#define IPTC_TWO_DIGITS(d)	(((d)[0] - '0') * 10 + ((d)[1] - '0'))
+
+/* Checks the contents of a dataset whose size is within the bounds of
+ * its format */
+static int
+iptc_data_format_ok (IptcFormat format, const unsigned char *d,
+		unsigned int size)
+{
+	int month, day;
+
+	switch (format) {
+	case IPTC_FORMAT_NUMERIC_STRING:
+		return iptc_digits (d, size);
+	case IPTC_FORMAT_DATE:
+		/* CCYYMMDD */
+		if (size != 8 || !iptc_digits (d, 8))
+			return 0;
+		month = IPTC_TWO_DIGITS (d + 4);
+		day = IPTC_TWO_DIGITS (d + 6);
+		return month >= 1 && month <= 12 && day >= 1 && day <= 31;
+	case IPTC_FORMAT_TIME:
+		/* HHMMSS+HHMM */
+		if (size != 11 || !iptc_digits (d, 6) ||
+				(d[6] != '+' && d[6] != '-') ||
+				!iptc_digits (d + 7, 4))
+			return 0;
+		return IPTC_TWO_DIGITS (d) < 24 && IPTC_TWO_DIGITS (d + 2) < 60 &&
+			IPTC_TWO_DIGITS (d + 4) < 60 &&
+			IPTC_TWO_DIGITS (d + 7) < 24 &&
+			IPTC_TWO_DIGITS (d + 9) < 60;
+	default:
+		return 1;
+	}
+}
+
+static void
+iptc_data_report (IptcValidationReport *report, IptcValidationCode code,
+		IptcRecord record, IptcTag tag, int index)
+{
+	if (report->count < report->max_problems && report->problems) {
+		IptcValidationProblem *p = report->problems + report->count;
+		p->code = code;
+		p->record = record;
+		p->tag = tag;
+		p->index = index;
+	}
+	report->count++;
+}
+
+/**
+ * iptc_data_validate:
+ * @data: collection of datasets to check
+ * @report: structure to be filled with the problems found, or NULL
+ *
+ * Checks a whole collection of datasets against the IIM specification
+ * as described by the tag table (see iptc_tag_get_info()).  For each
+ * dataset with a known record:tag, the size must be within the minimum
+ * and maximum for the tag, and numeric strings, dates (CCYYMMDD) and
+ * times (HHMMSS+HHMM) must be well formed.  Datasets that are not
+ * repeatable must not appear more than once.  Finally, every mandatory
+ * dataset of each record that is present in @data must be present as
+ * well.  Unknown datasets are not checked.  All of this is done in a
+ * single pass over the datasets and without allocating memory, and a
+ * collection loaded with iptc_data_load_lazy() is checked without
+ * creating its datasets.
+ *
+ * The application supplies the storage for the report.  Before the
+ * call, the problems member of @report may point to an array of
+ * max_problems elements, or be NULL if only the number of problems is
+ * needed.  After the call, the count member holds the number of
+ * problems found, and the first max_problems of them are described in
+ * the array in the order they were found, with the missing datasets
+ * last.  The index member of each problem is the position of the
+ * offending dataset in the collection, or -1 for a missing dataset.
+ *
+ * Returns: the number of problems found, 0 if @data is valid, or -1
+ * on error.
+ */
+int
+iptc_data_validate (IptcData *data, IptcValidationReport *report)
+{
+	IptcValidationReport r = { 0, NULL, 0 };
+	IptcTagFilter seen;
+	const IptcTagInfo *info;
+	unsigned int i, n, records = 0;
+
+	if (!data || !data->priv)
+		return -1;
+	if (!report)
+		report = &r;
+	report->count = 0;
+
+	iptc_tag_filter_clear (&seen);
+	n = data->priv->lazy_ds ? data->priv->n_lazy : data->count;
+
+	for (i = 0; i < n; i++) {
+		const unsigned char *d;
+		unsigned int size, record, tag;
+
+		if (data->priv->lazy_ds && !data->priv->lazy_ds[i]) {
+			record = data->priv->lazy_key[i] >> 8;
+			tag = data->priv->lazy_key[i] & 0xff;
+			d = data->priv->lazy_buf + data->priv->lazy_offset[i];
+			size = data->priv->lazy_size[i];
+		}
+		else {
+			IptcDataSet *e = data->priv->lazy_ds ?
+				data->priv->lazy_ds[i] : data->datasets[i];
+			record = e->record;
+			tag = e->tag;
+			d = e->data;
+			size = e->size;
+		}
+
+		if (record < 1 || record > 9)
+			continue;
+		records |= 1 << (record - 1);
+
+		info = iptc_tag_get_info (record, tag);
+		if (!info)
+			continue;
+
+		if (iptc_tag_filter_contains (&seen, record, tag)) {
+			if (info->repeatable == IPTC_NOT_REPEATABLE)
+				iptc_data_report (report,
+					IPTC_VALIDATION_REPEATED,
+					record, tag, i);
+		}
+		else
+			iptc_tag_filter_add (&seen, record, tag);
+
+		if (size < info->minbytes)
+			iptc_data_report (report, IPTC_VALIDATION_TOO_SHORT,
+					record, tag, i);
+		else if (size > info->maxbytes)
+			iptc_data_report (report, IPTC_VALIDATION_TOO_LONG,
+					record, tag, i);
+		else if (!iptc_data_format_ok (info->format, d, size))
+			iptc_data_report (report, IPTC_VALIDATION_BAD_FORMAT,
+					record, tag, i);
+	}
+
+	for (info = iptc_tag_get_table (); info->record; info++) {
+		if (info->mandatory == IPTC_MANDATORY &&
+				(records & (1 << (info->record - 1))) &&
+				!iptc_tag_filter_contains (&seen,
+					info->record, info->tag))
+			iptc_data_report (report, IPTC_VALIDATION_MISSING,
+					info->record, info->tag, -1);
+	}
+
+	return report->count;
+}
+
 /**
  * iptc_data_dump:
  * @data: collection of datasets to print
@@ -458,7 +1142,7 @@ iptc_data_dump (IptcData *data, unsigned int indent)
 		buf[i] = ' ';
 	buf[i] = '\0';
 
-	if (!data)
+	if (!data || iptc_data_materialize (data) < 0)
 		return;
 
 	printf ("%sDumping iptc data (%i datasets)...\n", buf,
@@ -467,33 +1151,565 @@ iptc_data_dump (IptcData *data, unsigned int indent)
 		iptc_dataset_dump (data->datasets[i], indent + 1);
 }
 
+#define IPTC_INDEXED(r,t)	((r) >= 1 && (r) <= 9 && (unsigned int) (t) < 256)
+
+/* Order used by iptc_data_sort() */
+#define IPTC_SORT_KEY(ds)	((((ds)->record & 0xff) << 8) | ((ds)->tag & 0xff))
+
+/* Links @ds at the end of the chain for its record:tag */
+static int
+iptc_data_index_append (IptcData *data, IptcDataSet *ds)
+{
+	IptcDataSet **heads, *head;
+
+	ds->priv->next = NULL;
+	ds->priv->last = NULL;
+	if (!IPTC_INDEXED (ds->record, ds->tag))
+		return 0;
+
+	heads = data->priv->index[ds->record - 1];
+	if (!heads) {
+		heads = iptc_mem_alloc (data->priv->mem,
+				256 * sizeof (IptcDataSet *));
+		if (!heads)
+			return -1;
+		data->priv->index[ds->record - 1] = heads;
+	}
+
+	head = heads[ds->tag];
+	if (!head) {
+		heads[ds->tag] = ds;
+		ds->priv->last = ds;
+	}
+	else {
+		head->priv->last->priv->next = ds;
+		head->priv->last = ds;
+	}
+	return 0;
+}
+
+/* Unlinks @ds from the chain for its record:tag */
+static void
+iptc_data_index_remove (IptcData *data, IptcDataSet *ds)
+{
+	IptcDataSet **heads, *head, *prev;
+
+	if (!IPTC_INDEXED (ds->record, ds->tag))
+		return;
+
+	heads = data->priv->index[ds->record - 1];
+	head = heads[ds->tag];
+	if (head == ds) {
+		heads[ds->tag] = ds->priv->next;
+		if (ds->priv->next)
+			ds->priv->next->priv->last = ds->priv->last;
+	}
+	else {
+		for (prev = head; prev->priv->next != ds; prev = prev->priv->next)
+			;
+		prev->priv->next = ds->priv->next;
+		if (head->priv->last == ds)
+			head->priv->last = prev;
+	}
+	ds->priv->next = NULL;
+	ds->priv->last = NULL;
+}
+
+static int
+iptc_data_index_build (IptcData *data)
+{
+	unsigned int i;
+
+	data->priv->sorted = 1;
+	for (i = 1; i < data->count && data->priv->sorted; i++)
+		if (IPTC_SORT_KEY (data->datasets[i - 1]) >
+				IPTC_SORT_KEY (data->datasets[i]))
+			data->priv->sorted = 0;
+
+	data->priv->index_valid = 0;
+	for (i = 0; i < 9; i++)
+		if (data->priv->index[i])
+			memset (data->priv->index[i], 0,
+					256 * sizeof (IptcDataSet *));
+
+	for (i = 0; i < data->count; i++)
+		if (iptc_data_index_append (data, data->datasets[i]) < 0)
+			return -1;
+
+	data->priv->index_valid = 1;
+	return 0;
+}
+
+void
+iptc_data_dataset_retagged (IptcData *data, IptcDataSet *ds)
+{
+	IptcDataPrivate *priv;
+	unsigned int pos;
+
+	if (!data || !data->priv || !ds) return;
+	priv = data->priv;
+
+	/* Lazy lookups match on the key of the header, not on the
+	 * dataset, so keep it in step.  A key too large for the header
+	 * can only be held by the datasets array. */
+	if (priv->edit)
+		iptc_data_edit_retagged (priv->edit, ds);
+
+	pos = ds->priv->pos;
+	if (priv->lazy_ds && pos < priv->n_lazy && priv->lazy_ds[pos] == ds) {
+		if ((unsigned int) ds->record <= 0xff &&
+				(unsigned int) ds->tag <= 0xff) {
+			priv->lazy_key[pos] = (ds->record << 8) | ds->tag;
+			return;
+		}
+		if (iptc_data_materialize (data) == 0)
+			return;
+	}
+	iptc_data_index_build (data);
+}
+
 static int
 iptc_data_dataset_index (IptcData *data, IptcDataSet *ds)
 {
 	unsigned int i;
 
-	if (!data || !ds)
-		return -1;
+	if (!data || !ds || iptc_data_materialize (data) < 0)
+		return -1;
+
+	/* Search the dataset */
+	for (i = 0; i < data->count; i++)
+		if (data->datasets[i] == ds)
+			return i;
+
+	return -1;
+}
+
+static int
+iptc_data_grow (IptcData *data, unsigned int count)
+{
+	IptcDataSet **datasets;
+
+	if (count <= data->priv->capacity)
+		return 0;
+
+	datasets = iptc_mem_realloc (data->priv->mem, data->datasets,
+			sizeof (IptcDataSet *) * count);
+	if (!datasets) {
+		IPTC_LOG_NO_MEMORY (data->priv->log, "IptcData",
+				(int) (sizeof (IptcDataSet *) * count));
+		return -1;
+	}
+	data->datasets = datasets;
+	data->priv->capacity = count;
+	return 0;
+}
+
+/**
+ * iptc_data_reserve:
+ * @data: collection of datasets
+ * @count: number of datasets the collection should be able to hold
+ *
+ * Makes sure that @data can hold at least @count datasets without
+ * having to grow its internal array again.  The array otherwise grows
+ * geometrically as datasets are added, and iptc_data_load() reserves
+ * room for all the datasets it finds before adding them, so this is
+ * only useful before adding a large, known number of datasets one by
+ * one.
+ *
+ * Returns: 0 on success, -1 on error
+ */
+int
+iptc_data_reserve (IptcData *data, unsigned int count)
+{
+	if (!data || !data->priv || data->priv->frozen ||
+			iptc_data_materialize (data) < 0)
+		return -1;
+
+	return iptc_data_grow (data, count);
+}
+
+/* Creates the dataset for lazily loaded header @i if that has not been
+ * done yet.  The reference is owned by the entry. */
+static IptcDataSet *
+iptc_data_lazy_get (IptcData *data, unsigned int i)
+{
+	IptcDataPrivate *priv = data->priv;
+	IptcDataSet *ds;
+
+	if (priv->lazy_ds[i])
+		return priv->lazy_ds[i];
+
+	ds = iptc_dataset_new_mem (priv->mem);
+	if (!ds)
+		return NULL;
+	iptc_dataset_set_tag (ds, priv->lazy_key[i] >> 8,
+			priv->lazy_key[i] & 0xff);
+	iptc_dataset_set_data_borrowed (ds, priv->lazy_buf +
+			priv->lazy_offset[i], priv->lazy_size[i],
+			priv->lazy_borrow);
+	ds->parent = data;
+	ds->priv->pos = i;
+
+	return priv->lazy_ds[i] = ds;
+}
+
+/* Turns the lazily loaded headers, if any, into the datasets array */
+static int
+iptc_data_materialize (IptcData *data)
+{
+	IptcDataPrivate *priv = data->priv;
+	unsigned int i;
+
+	if (!priv->lazy_ds)
+		return 0;
+
+	if (iptc_data_grow (data, priv->n_lazy) < 0)
+		return -1;
+	for (i = 0; i < priv->n_lazy; i++)
+		if (!iptc_data_lazy_get (data, i))
+			return -1;
+
+	if (iptc_log_enabled (priv->log, IPTC_LOG_CODE_DEBUG))
+		iptc_log (priv->log, IPTC_LOG_CODE_DEBUG, "IptcData",
+			  "Decoding all %i lazily loaded datasets.",
+			  priv->n_lazy);
+
+	memcpy (data->datasets, priv->lazy_ds,
+			priv->n_lazy * sizeof (IptcDataSet *));
+	data->count = priv->n_lazy;
+	iptc_data_index_build (data);
+
+	iptc_mem_free (priv->mem, priv->lazy_ds);
+	priv->lazy_ds = NULL;
+	priv->lazy_offset = NULL;
+	priv->lazy_size = NULL;
+	priv->lazy_key = NULL;
+	priv->lazy_buf = NULL;
+	iptc_borrow_unref (priv->lazy_borrow);
+	priv->lazy_borrow = NULL;
+	priv->n_lazy = 0;
+	return 0;
+}
+
+#define IPTC_LAZY_ENTRY_SIZE	(sizeof (IptcDataSet *) + \
+		2 * sizeof (unsigned int) + sizeof (unsigned short))
+
+/**
+ * iptc_data_load_lazy:
+ * @data: an empty collection to be populated with the loaded datasets
+ * @buf: data buffer to be parsed, containing IPTC data
+ * @size: length of data buffer to be parsed
+ * @destroy: function called once nothing refers to @buf anymore, or NULL
+ * @user_data: argument passed to @destroy
+ *
+ * Loads a buffer containing raw IPTC data into @data while doing as
+ * little work as possible: a single pass over the dataset headers
+ * records the record, tag, position and length of each dataset in a
+ * compact index, and nothing else is decoded.  Searching this index
+ * only reads 2 bytes per dataset.  An #IptcDataSet is
+ * created, borrowing its payload from @buf, only when
+ * iptc_data_get_dataset(), iptc_data_get_next_dataset() or
+ * iptc_data_foreach_dataset() first returns it.  Any other operation
+ * on @data, such as adding or removing a dataset, sorting or saving,
+ * creates all the remaining datasets at once, after which @data
+ * behaves as if it had been loaded with iptc_data_load_borrowed().
+ *
+ * This suits jobs that only look for a few datasets in many files.
+ * Until all the datasets have been created, the datasets and count
+ * members of @data are empty, so an application that accesses them
+ * directly must not use this function.  @buf must stay valid and
+ * unmodified for as long as @data and its datasets are in use, which
+ * @destroy reports as described for iptc_data_load_borrowed().
+ *
+ * Returns: 0 on success, -1 on failure or if @data is not empty.  As
+ * with iptc_data_load(), the datasets preceding a corrupt one are still
+ * loaded in the failure case.
+ */
+int
+iptc_data_load_lazy (IptcData *data, const unsigned char *buf,
+		unsigned int size, IptcDestroyFunc destroy, void *user_data)
+{
+	IptcDataPrivate *priv;
+	IptcBorrow *borrow;
+	unsigned int n, skipped, payload, end, off, len, doff;
+
+	if (iptc_data_borrow (data, destroy, user_data, &borrow) < 0)
+		return -1;
+	if (!data || !data->priv || !buf || !size)
+		goto failure;
+	priv = data->priv;
+	if (priv->frozen || priv->edit || data->count || priv->lazy_ds)
+		goto failure;
+
+	end = iptc_data_scan (buf, size, NULL, &n, &skipped, &payload);
+	if (!n) {
+		iptc_borrow_unref (borrow);
+		return IPTC_SCAN_CORRUPT (buf, size, end) ? -1 : 0;
+	}
+
+	/* Most aligned array first */
+	priv->lazy_ds = iptc_mem_alloc (priv->mem, IPTC_LAZY_ENTRY_SIZE * n);
+	if (!priv->lazy_ds) {
+		IPTC_LOG_NO_MEMORY (priv->log, "IptcData",
+				(int) (IPTC_LAZY_ENTRY_SIZE * n));
+		goto failure;
+	}
+	priv->lazy_offset = (unsigned int *) (priv->lazy_ds + n);
+	priv->lazy_size = priv->lazy_offset + n;
+	priv->lazy_key = (unsigned short *) (priv->lazy_size + n);
+	priv->lazy_buf = buf;
+	priv->lazy_borrow = borrow;
+
+	for (off = 0, n = 0; off < end; off += doff + len, n++) {
+		doff = iptc_data_header_size (buf + off, &len);
+		priv->lazy_key[n] = (buf[off+1] << 8) | buf[off+2];
+		priv->lazy_offset[n] = off + doff;
+		priv->lazy_size[n] = len;
+	}
+	priv->n_lazy = n;
+
+	if (iptc_log_enabled (priv->log, IPTC_LOG_CODE_DEBUG))
+		iptc_log (priv->log, IPTC_LOG_CODE_DEBUG, "IptcData",
+			  "Indexed %i datasets for lazy loading.", n);
+
+	return IPTC_SCAN_CORRUPT (buf, size, end) ? -1 : 0;
+
+failure:
+	iptc_borrow_unref (borrow);
+	return -1;
+}
+
+/**
+ * iptc_data_freeze:
+ * @data: collection of datasets to take a snapshot of
+ *
+ * Makes an immutable copy of a collection of datasets.  The copy is
+ * laid out in a single memory allocation, which holds its datasets,
+ * their contents and the index used by iptc_data_get_next_dataset().
+ * Since nothing in a frozen collection is ever written to, any number
+ * of threads may read it at the same time without locking.  The
+ * functions that modify a collection or its datasets fail on a frozen
+ * collection, and iptc_dataset_ref() and iptc_dataset_unref() have no
+ * effect on its datasets, which stay valid as long as the collection.
+ * Apart from decoding any lazily loaded datasets, @data is unmodified
+ * by this function and remains usable as before.
+ *
+ * Returns: pointer to the new frozen #IptcData object with a refcount
+ * of 1, or NULL on error
+ */
+IptcData *
+iptc_data_freeze (IptcData *data)
+{
+	IptcData *frozen;
+	IptcDataPrivate *priv;
+	unsigned char *sets, *p;
+	size_t size, payload = 0;
+	unsigned int i, n_skipped, n_tables = 0;
+	int used[9];
+
+	if (!data || !data->priv || iptc_data_materialize (data) < 0)
+		return NULL;
+	n_skipped = data->priv->n_skipped;
+
+	memset (used, 0, sizeof (used));
+	for (i = 0; i < data->count; i++) {
+		IptcDataSet *ds = data->datasets[i];
+
+		if (IPTC_INDEXED (ds->record, ds->tag) && !used[ds->record - 1]) {
+			used[ds->record - 1] = 1;
+			n_tables++;
+		}
+		payload += ds->size;
+	}
+	for (i = 0; i < n_skipped; i++)
+		payload += data->priv->skipped[i].size;
+
+	/* Everything but the payloads is pointer aligned */
+	size = sizeof (IptcData) + sizeof (IptcDataPrivate) +
+		(size_t) data->count * (sizeof (IptcDataSet *) +
+			sizeof (IptcDataSet) + sizeof (IptcDataSetPrivate)) +
+		n_tables * 256 * sizeof (IptcDataSet *) +
+		n_skipped * sizeof (IptcDataSkipped) + payload;
+	if (size != (IptcLong) size)
+		return NULL;
+
+	frozen = iptc_mem_alloc (data->priv->mem, (IptcLong) size);
+	if (!frozen) {
+		IPTC_LOG_NO_MEMORY (data->priv->log, "IptcData",
+				(int) size);
+		return NULL;
+	}
+	priv = (IptcDataPrivate *) (frozen + 1);
+	frozen->priv = priv;
+	iptc_atomic_init (&priv->ref_count, 1);
+	priv->frozen = 1;
+	priv->mem = data->priv->mem;
+	iptc_mem_ref (priv->mem);
+	priv->log = data->priv->log;
+	iptc_log_ref (priv->log);
+
+	frozen->datasets = (IptcDataSet **) (priv + 1);
+	frozen->count = priv->capacity = data->count;
+	p = (unsigned char *) (frozen->datasets + data->count);
+	for (i = 0; i < 9; i++)
+		if (used[i]) {
+			priv->index[i] = (IptcDataSet **) p;
+			p += 256 * sizeof (IptcDataSet *);
+		}
+	sets = p;
+	p += data->count * (sizeof (IptcDataSet) + sizeof (IptcDataSetPrivate));
+	if (n_skipped) {
+		priv->skipped = (IptcDataSkipped *) p;
+		priv->n_skipped = n_skipped;
+		p += n_skipped * sizeof (IptcDataSkipped);
+	}
+
+	for (i = 0; i < data->count; i++) {
+		IptcDataSet *src = data->datasets[i];
+		IptcDataSet *ds = (IptcDataSet *) (sets + i *
+			(sizeof (IptcDataSet) + sizeof (IptcDataSetPrivate)));
+
+		ds->priv = (IptcDataSetPrivate *) (ds + 1);
+		iptc_atomic_init (&ds->priv->ref_count, 1);
+		ds->priv->flags = IPTC_DATASET_FROZEN | IPTC_DATASET_BORROWED;
+		ds->priv->mem = priv->mem;
+		ds->priv->borrow = NULL;
+		ds->record = src->record;
+		ds->tag = src->tag;
+		ds->info = src->info;
+		ds->parent = frozen;
+		if (src->size) {
+			memcpy (p, src->data, src->size);
+			ds->data = p;
+			ds->size = src->size;
+			p += src->size;
+		}
+		frozen->datasets[i] = ds;
+	}
+	for (i = 0; i < n_skipped; i++) {
+		const IptcDataSkipped *k = data->priv->skipped + i;
+
+		memcpy (p, k->buf, k->size);
+		priv->skipped[i].buf = p;
+		priv->skipped[i].size = k->size;
+		priv->skipped[i].borrow = NULL;
+		p += k->size;
+	}
+
+	/* Cannot fail, the index tables are already there */
+	iptc_data_index_build (frozen);
+
+	return frozen;
+}
+
+/**
+ * iptc_data_is_frozen:
+ * @data: collection of datasets
+ *
+ * Tells whether a collection was created by iptc_data_freeze() and so
+ * cannot be modified.
+ *
+ * Returns: 1 if @data is frozen, 0 otherwise
+ */
+int
+iptc_data_is_frozen (IptcData *data)
+{
+	if (!data || !data->priv)
+		return 0;
+	return data->priv->frozen;
+}
+
+/**
+ * iptc_data_clone:
+ * @data: collection of datasets to be cloned
+ *
+ * Makes a copy of a collection of datasets that can be modified
+ * independently of the original.  Instead of copying the contents of
+ * every dataset, the clone shares them with the original, and a
+ * dataset only gets its own copy when a new value is set on either
+ * side with iptc_dataset_set_data() or a similar function.  For this
+ * reason the contents of a dataset must never be changed by writing
+ * directly into its data buffer.  Datasets loaded with
+ * iptc_data_load_borrowed() keep borrowing the same buffer in the
+ * clone, which holds references on it in the same way.  A frozen
+ * collection may be cloned, in which case the clone is not frozen and
+ * the contents of its datasets are copied.  Apart from decoding any
+ * lazily loaded datasets, @data is unmodified by this function.  This
+ * allocation will set the #IptcData refcount to 1, so use
+ * iptc_data_unref() when finished with the object.
+ *
+ * Returns: pointer to the new #IptcData object, NULL on error
+ */
+IptcData *
+iptc_data_clone (IptcData *data)
+{
+	IptcData *clone;
+	IptcDataPrivate *priv;
+	unsigned int i, n_skipped;
+
+	if (!data || !data->priv || iptc_data_materialize (data) < 0)
+		return NULL;
+
+	clone = iptc_data_new_mem (data->priv->mem);
+	if (!clone)
+		return NULL;
+	priv = clone->priv;
+	iptc_data_log (clone, data->priv->log);
+	if (iptc_data_reserve (clone, data->count) < 0)
+		goto failure;
+
+	n_skipped = data->priv->n_skipped;
+	if (n_skipped) {
+		priv->skipped = iptc_mem_alloc (priv->mem,
+				n_skipped * sizeof (IptcDataSkipped));
+		if (!priv->skipped)
+			goto failure;
+		memcpy (priv->skipped, data->priv->skipped,
+				n_skipped * sizeof (IptcDataSkipped));
+		for (i = 0; i < n_skipped; i++)
+			iptc_borrow_ref (priv->skipped[i].borrow);
+		priv->n_skipped = n_skipped;
+		priv->keep = data->priv->frozen ? data : data->priv->keep;
+		iptc_data_ref (priv->keep);
+	}
 
-	/* Search the dataset */
-	for (i = 0; i < data->count; i++)
-		if (data->datasets[i] == ds)
-			return i;
+	for (i = 0; i < data->count; i++) {
+		IptcDataSet *ds = iptc_dataset_share (data->datasets[i]);
 
-	return -1;
+		if (!ds)
+			goto failure;
+		if (iptc_data_add_dataset (clone, ds) < 0) {
+			iptc_dataset_unref (ds);
+			goto failure;
+		}
+		iptc_dataset_unref (ds);
+	}
+
+	return clone;
+
+failure:
+	iptc_data_unref (clone);
+	return NULL;
 }
 
 static int
 iptc_data_add_dataset_index (IptcData *data, IptcDataSet *dataset, unsigned int index)
 {
-	if (!data || !data->priv || !dataset || dataset->parent ||
+	if (!data || !data->priv || data->priv->frozen || data->priv->edit ||
+			!dataset || dataset->parent ||
+			iptc_data_materialize (data) < 0 ||
 			index > data->count)
 		return -1;
 
+	if (data->count == data->priv->capacity) {
+		unsigned int capacity = 2 * data->priv->capacity;
+		if (capacity < 8)
+			capacity = 8;
+		if (iptc_data_grow (data, capacity) < 0)
+			return -1;
+	}
+
 	dataset->parent = data;
-	data->datasets = iptc_mem_realloc (data->priv->mem,
-		data->datasets, sizeof (IptcDataSet *) * (data->count + 1));
-	if (!data->datasets) return -1;
 	if (index != data->count)
 		memmove (data->datasets + index + 1, data->datasets + index,
 				sizeof(IptcDataSet *) * (data->count - index));
@@ -501,6 +1717,18 @@ iptc_data_add_dataset_index (IptcData *data, IptcDataSet *dataset, unsigned int
 	iptc_dataset_ref (dataset);
 	data->count++;
 
+	/* Appending keeps the index up to date, inserting elsewhere
+	 * would have to find the neighbours first. */
+	if (index != data->count - 1 || !data->priv->index_valid)
+		iptc_data_index_build (data);
+	else {
+		if (index && IPTC_SORT_KEY (data->datasets[index - 1]) >
+				IPTC_SORT_KEY (dataset))
+			data->priv->sorted = 0;
+		if (iptc_data_index_append (data, dataset) < 0)
+			data->priv->index_valid = 0;
+	}
+
 	return 0;
 }
 
@@ -520,7 +1748,8 @@ iptc_data_add_dataset_index (IptcData *data, IptcDataSet *dataset, unsigned int
 int
 iptc_data_add_dataset (IptcData *data, IptcDataSet *dataset)
 {
-	if (!data) return -1;
+	if (!data || !data->priv || iptc_data_materialize (data) < 0)
+		return -1;
 
 	if (iptc_data_add_dataset_index (data, dataset, data->count) < 0)
 		return -1;
@@ -599,21 +1828,22 @@ iptc_data_remove_dataset (IptcData *data, IptcDataSet *dataset)
 {
 	unsigned int i;
 
-	if (!data || !data->priv || !dataset ||
-		(dataset->parent != data)) return -1;
+	if (!data || !data->priv || data->priv->frozen || data->priv->edit ||
+		!dataset || (dataset->parent != data)) return -1;
 
 	/* Search the dataset */
 	i = iptc_data_dataset_index (data, dataset);
 	if (i < 0) return -1;
 
+	if (data->priv->index_valid)
+		iptc_data_index_remove (data, dataset);
+
 	/* Remove the dataset */
 	memmove (data->datasets + i, data->datasets + i + 1,
 		 sizeof (IptcDataSet *) * (data->count - i - 1));
 	data->count--;
 	dataset->parent = NULL;
 	iptc_dataset_unref (dataset);
-	data->datasets = iptc_mem_realloc (data->priv->mem, data->datasets,
-					sizeof(IptcDataSet *) * data->count);
 
 	return 0;
 }
@@ -630,7 +1860,9 @@ iptc_data_remove_dataset (IptcData *data, IptcDataSet *dataset)
  * when a collection contains more than one dataset with the same record
  * and tag identifier (for example, the keywords tag appears once for
  * each keyword in the IPTC metadata).  When @ds is NULL, this function
- * is equivalent to iptc_data_get_dataset().
+ * is equivalent to iptc_data_get_dataset().  The collection keeps an
+ * index of its datasets by record and tag, so each call takes constant
+ * time when @ds has the requested record and tag (or is NULL).
  *
  * Returns: pointer to dataset if found, NULL if no matching dataset found
  */
@@ -640,8 +1872,53 @@ iptc_data_get_next_dataset (IptcData *data, IptcDataSet *ds,
 {
 	int i = 0;
 
-	if (!data)
+	if (!data || !data->priv)
+		return NULL;
+
+	if (data->priv->lazy_ds) {
+		IptcDataPrivate *priv = data->priv;
+		unsigned int j = 0, key;
+
+		/* Scan the keys, and create only the dataset found */
+		if (ds) {
+			j = ds->priv->pos;
+			if (ds->parent != data || j >= priv->n_lazy ||
+					priv->lazy_ds[j] != ds)
+				return NULL;
+			j++;
+		}
+		if ((unsigned int) record > 0xff || (unsigned int) tag > 0xff)
+			return NULL;
+		key = (record << 8) | tag;
+		for (; j < priv->n_lazy; j++)
+			if (priv->lazy_key[j] == key) {
+				IptcDataSet *found = iptc_data_lazy_get (data, j);
+				if (found)
+					iptc_dataset_ref (found);
+				return found;
+			}
 		return NULL;
+	}
+
+	/* Use the index unless asked for a different record:tag than
+	 * the one of @ds */
+	if (IPTC_INDEXED (record, tag) && (!ds || (ds->record == record &&
+			ds->tag == tag)) && data->priv->index_valid) {
+		IptcDataSet *next;
+
+		if (ds) {
+			if (ds->parent != data)
+				return NULL;
+			next = ds->priv->next;
+		}
+		else {
+			IptcDataSet **heads = data->priv->index[record - 1];
+			next = heads ? heads[tag] : NULL;
+		}
+		if (next)
+			iptc_dataset_ref (next);
+		return next;
+	}
 
 	if (ds) {
 		i = iptc_data_dataset_index (data, ds);
@@ -695,20 +1972,58 @@ iptc_data_foreach_dataset (IptcData *data,
 	if (!data || !func)
 		return;
 
-	for (i = 0; i < data->count; i++)
+	/* If @func modifies @data, all the datasets are created and the
+	 * iteration carries on through the datasets array. */
+	for (i = 0; data->priv->lazy_ds && i < data->priv->n_lazy; i++) {
+		IptcDataSet *ds = iptc_data_lazy_get (data, i);
+		if (!ds)
+			return;
+		func (ds, user);
+	}
+
+	for (; i < data->count; i++)
 		func (data->datasets[i], user);
 }
 
-static
-int dataset_compare (const void * d1, const void * d2)
+/* Stable LSD radix sort on the 16 bit record:tag key, one counting
+ * pass per byte.  A pass is skipped when all the datasets have the
+ * same value for that byte, as is common for the record. */
+static int
+iptc_data_radix_sort (IptcData *data)
 {
-	IptcDataSet * set1 = *(IptcDataSet **)d1;
-	IptcDataSet * set2 = *(IptcDataSet **)d2;
+	IptcDataSet **tmp, **src, **dst, **swap;
+	unsigned int count[256], i, shift, sum, c, n = data->count;
+
+	tmp = iptc_mem_alloc (data->priv->mem, n * sizeof (IptcDataSet *));
+	if (!tmp)
+		return -1;
 
-	if (set1->record != set2->record)
-		return set1->record - set2->record;
+	src = data->datasets;
+	dst = tmp;
+	for (shift = 0; shift < 16; shift += 8) {
+		memset (count, 0, sizeof (count));
+		for (i = 0; i < n; i++)
+			count[(IPTC_SORT_KEY (src[i]) >> shift) & 0xff]++;
+		if (count[(IPTC_SORT_KEY (src[0]) >> shift) & 0xff] == n)
+			continue;
+
+		for (i = 0, sum = 0; i < 256; i++) {
+			c = count[i];
+			count[i] = sum;
+			sum += c;
+		}
+		for (i = 0; i < n; i++)
+			dst[count[(IPTC_SORT_KEY (src[i]) >> shift) & 0xff]++] =
+				src[i];
+		swap = src;
+		src = dst;
+		dst = swap;
+	}
+	if (src != data->datasets)
+		memcpy (data->datasets, src, n * sizeof (IptcDataSet *));
 
-	return set1->tag - set2->tag;
+	iptc_mem_free (data->priv->mem, tmp);
+	return 0;
 }
 
 /**
@@ -718,16 +2033,33 @@ int dataset_compare (const void * d1, const void * d2)
  * Sorts a collection of datasets in ascending order first by record
  * number and second by tag number.  It can be useful to call this
  * function before saving IPTC data in order to maintain a more
- * organized file.
+ * organized file.  The sort is stable, so repeated datasets such as
+ * keywords keep their relative order, and takes linear time.  A
+ * collection that is already sorted is left untouched at no cost.
  */
 void
 iptc_data_sort (IptcData *data)
 {
-	if (!data)
+	unsigned int i, j;
+
+	if (!data || !data->priv || data->priv->frozen || data->priv->edit ||
+			iptc_data_materialize (data) < 0)
 		return;
+	if (data->priv->sorted)
+		return;
+
+	if (iptc_data_radix_sort (data) < 0) {
+		/* Out of memory, fall back to an insertion sort */
+		for (i = 1; i < data->count; i++) {
+			IptcDataSet *ds = data->datasets[i];
 
-	qsort (data->datasets, data->count, sizeof (IptcDataSet *),
-			dataset_compare);
+			for (j = i; j > 0 && IPTC_SORT_KEY (data->datasets[j - 1]) >
+					IPTC_SORT_KEY (ds); j--)
+				data->datasets[j] = data->datasets[j - 1];
+			data->datasets[j] = ds;
+		}
+	}
+	iptc_data_index_build (data);
 }
 
 /**
@@ -950,6 +2282,735 @@ iptc_data_add_dataset_with_contents (IptcData *data, IptcRecord record,
 	return ret;
 }
 
+#define IPTC_EDIT_NONE	((unsigned int) -1)
+
+/* A dataset added through an edit.  The entries added before the same
+ * original dataset, or at the end for anchor == count, form a group
+ * linked in their final order, and rank increases along the group. */
+typedef struct {
+	IptcDataSet *ds;	/* NULL once removed again */
+	unsigned int anchor;
+	unsigned int rank;
+	unsigned int prev;
+	unsigned int next;
+	/* Neighbours with the same record:tag, in collection order */
+	unsigned int key_prev;
+	unsigned int key_next;
+} IptcDataEditEntry;
+
+/* Added datasets with a given record:tag.  entry and orig remember
+ * where the last search for it stopped, as an entry and as a position
+ * in the original collection, so that walking forward through the
+ * matches does not start over each time. */
+typedef struct {
+	unsigned int head;
+	unsigned int tail;
+	unsigned int entry;
+	unsigned int orig;
+} IptcDataEditKey;
+
+struct _IptcDataEdit
+{
+	IptcData *data;
+
+	/* Number of datasets in the collection when the edit began */
+	unsigned int count;
+	unsigned char *removed;
+
+	IptcDataEditEntry *entries;
+	unsigned int n_entries;
+	unsigned int n_alloc;
+
+	/* First and last entry of each group, count + 1 of each */
+	unsigned int *heads;
+	unsigned int *tails;
+
+	/* The entries chained by record:tag, parallel to the index of
+	 * the collection, one table of 256 tags per record allocated
+	 * when first needed.  keys_valid is cleared when an added dataset
+	 * changes its record:tag or a table cannot be allocated, and the
+	 * chains are then rebuilt by the next search. */
+	IptcDataEditKey *keys[9];
+	int keys_valid;
+};
+
+/**
+ * iptc_data_edit_begin:
+ * @data: collection of datasets to be modified
+ *
+ * Starts a batch of changes to a collection of datasets.  Datasets
+ * are added, removed or replaced by calling the iptc_data_edit
+ * functions on the returned object, and the collection itself is only
+ * changed, in a single pass over its datasets, by
+ * iptc_data_edit_commit().  This avoids moving the datasets around
+ * once for every change.  Until the edit is committed or abandoned
+ * with iptc_data_edit_abort(), the other functions that add or remove
+ * datasets fail on @data, and the functions that look datasets up
+ * return them as they were before the edit.  Use
+ * iptc_data_edit_get_next_dataset() to find them as they will be
+ * after it.  The edit holds a reference to @data.
+ *
+ * Returns: pointer to the new #IptcDataEdit object, NULL on error or
+ * if @data is frozen or already being edited
+ */
+IptcDataEdit *
+iptc_data_edit_begin (IptcData *data)
+{
+	IptcDataEdit *edit;
+	unsigned int i;
+
+	if (!data || !data->priv || data->priv->frozen || data->priv->edit ||
+			iptc_data_materialize (data) < 0)
+		return NULL;
+
+	edit = iptc_mem_alloc (data->priv->mem, sizeof (IptcDataEdit));
+	if (!edit)
+		return NULL;
+	edit->data = data;
+	edit->count = data->count;
+	edit->heads = iptc_mem_alloc (data->priv->mem,
+			2 * (data->count + 1) * sizeof (unsigned int));
+	if (data->count)
+		edit->removed = iptc_mem_alloc (data->priv->mem, data->count);
+	if (!edit->heads || (data->count && !edit->removed)) {
+		IPTC_LOG_NO_MEMORY (data->priv->log, "IptcData",
+				(int) (data->count * 9));
+		iptc_mem_free (data->priv->mem, edit->heads);
+		iptc_mem_free (data->priv->mem, edit);
+		return NULL;
+	}
+	edit->tails = edit->heads + data->count + 1;
+	for (i = 0; i <= data->count; i++)
+		edit->heads[i] = edit->tails[i] = IPTC_EDIT_NONE;
+
+	edit->keys_valid = 1;
+
+	for (i = 0; i < data->count; i++)
+		data->datasets[i]->priv->pos = i;
+	data->priv->edit = edit;
+	iptc_data_ref (data);
+
+	return edit;
+}
+
+/* Tells where @ds is in the collection being edited.  Returns 1 and
+ * sets *pos for one of the original datasets, 0 and sets *pos to the
+ * entry for a pending one, or -1 if @ds is not (or no longer) part of
+ * the edited collection. */
+static int
+iptc_data_edit_locate (IptcDataEdit *edit, IptcDataSet *ds,
+		unsigned int *pos)
+{
+	if (!edit || !ds || ds->parent != edit->data)
+		return -1;
+
+	*pos = ds->priv->pos;
+	if (ds->priv->flags & IPTC_DATASET_PENDING)
+		return *pos < edit->n_entries &&
+			edit->entries[*pos].ds == ds ? 0 : -1;
+	return *pos < edit->count && edit->data->datasets[*pos] == ds &&
+		!edit->removed[*pos] ? 1 : -1;
+}
+
+/* Entry @e comes before the position (@anchor, @rank) of the edited
+ * collection, where the original dataset at @anchor has rank
+ * IPTC_EDIT_NONE, after all the entries of its group */
+#define IPTC_EDIT_BEFORE(e,a,r) \
+	((e)->anchor < (a) || ((e)->anchor == (a) && (e)->rank < (r)))
+#define IPTC_EDIT_AFTER(e,a,r) \
+	((e)->anchor > (a) || ((e)->anchor == (a) && (e)->rank > (r)))
+
+/* Returns the chain for @record:@tag, allocating its table if needed */
+static IptcDataEditKey *
+iptc_data_edit_key (IptcDataEdit *edit, IptcRecord record, IptcTag tag)
+{
+	IptcDataEditKey *keys;
+	unsigned int i;
+
+	keys = edit->keys[record - 1];
+	if (!keys) {
+		keys = iptc_mem_alloc (edit->data->priv->mem,
+				256 * sizeof (IptcDataEditKey));
+		if (!keys)
+			return NULL;
+		for (i = 0; i < 256; i++)
+			keys[i].head = keys[i].tail = keys[i].entry =
+				keys[i].orig = IPTC_EDIT_NONE;
+		edit->keys[record - 1] = keys;
+	}
+	return keys + tag;
+}
+
+/* Links entry @j into the chain for its record:tag.  Entries are
+ * mostly added at the end, so the place is searched from the tail. */
+static int
+iptc_data_edit_key_link (IptcDataEdit *edit, unsigned int j)
+{
+	IptcDataEditEntry *e = edit->entries + j;
+	IptcDataEditKey *key;
+	unsigned int k;
+
+	e->key_prev = e->key_next = IPTC_EDIT_NONE;
+	if (!IPTC_INDEXED (e->ds->record, e->ds->tag))
+		return 0;
+	key = iptc_data_edit_key (edit, e->ds->record, e->ds->tag);
+	if (!key)
+		return -1;
+
+	for (k = key->tail; k != IPTC_EDIT_NONE &&
+			!IPTC_EDIT_BEFORE (edit->entries + k, e->anchor,
+				e->rank);
+			k = edit->entries[k].key_prev)
+		;
+	e->key_prev = k;
+	if (k == IPTC_EDIT_NONE) {
+		e->key_next = key->head;
+		key->head = j;
+	}
+	else {
+		e->key_next = edit->entries[k].key_next;
+		edit->entries[k].key_next = j;
+	}
+	if (e->key_next == IPTC_EDIT_NONE)
+		key->tail = j;
+	else
+		edit->entries[e->key_next].key_prev = j;
+	return 0;
+}
+
+/* Unlinks entry @j from the chain for its record:tag */
+static void
+iptc_data_edit_key_unlink (IptcDataEdit *edit, unsigned int j)
+{
+	IptcDataEditEntry *e = edit->entries + j;
+	IptcDataEditKey *key;
+
+	if (!edit->keys_valid || !IPTC_INDEXED (e->ds->record, e->ds->tag))
+		return;
+
+	key = edit->keys[e->ds->record - 1] + e->ds->tag;
+	if (e->key_prev == IPTC_EDIT_NONE)
+		key->head = e->key_next;
+	else
+		edit->entries[e->key_prev].key_next = e->key_next;
+	if (e->key_next == IPTC_EDIT_NONE)
+		key->tail = e->key_prev;
+	else
+		edit->entries[e->key_next].key_prev = e->key_prev;
+	if (key->entry == j)
+		key->entry = e->key_prev;
+}
+
+/* Rebuilds the chains of all the entries, in collection order */
+static int
+iptc_data_edit_key_build (IptcDataEdit *edit)
+{
+	unsigned int i, j;
+
+	edit->keys_valid = 0;
+	for (i = 0; i < 9; i++) {
+		if (!edit->keys[i])
+			continue;
+		for (j = 0; j < 256; j++)
+			edit->keys[i][j].head = edit->keys[i][j].tail =
+				edit->keys[i][j].entry =
+				edit->keys[i][j].orig = IPTC_EDIT_NONE;
+	}
+
+	for (i = 0; i <= edit->count; i++)
+		for (j = edit->heads[i]; j != IPTC_EDIT_NONE;
+				j = edit->entries[j].next)
+			if (iptc_data_edit_key_link (edit, j) < 0)
+				return -1;
+
+	edit->keys_valid = 1;
+	return 0;
+}
+
+/* Called when @ds, part of the collection being edited, changes its
+ * record:tag */
+static void
+iptc_data_edit_retagged (IptcDataEdit *edit, IptcDataSet *ds)
+{
+	if (ds->priv->flags & IPTC_DATASET_PENDING)
+		edit->keys_valid = 0;
+}
+
+/* Records @newds as added in the group of @anchor, before the entry
+ * @before or at the end of the group */
+static int
+iptc_data_edit_insert (IptcDataEdit *edit, IptcDataSet *newds,
+		unsigned int anchor, unsigned int before)
+{
+	IptcMem *mem = edit->data->priv->mem;
+	IptcDataEditEntry *e;
+	unsigned int j, k, rank;
+
+	if (!newds || newds->parent)
+		return -1;
+
+	if (edit->n_entries == edit->n_alloc) {
+		unsigned int n = edit->n_alloc ? 2 * edit->n_alloc : 8;
+		IptcDataEditEntry *entries;
+
+		entries = iptc_mem_realloc (mem, edit->entries,
+				n * sizeof (IptcDataEditEntry));
+		if (!entries) {
+			IPTC_LOG_NO_MEMORY (edit->data->priv->log,
+					"IptcData",
+					(int) (n * sizeof (IptcDataEditEntry)));
+			return -1;
+		}
+		edit->entries = entries;
+		edit->n_alloc = n;
+	}
+
+	j = edit->n_entries++;
+	e = edit->entries + j;
+	e->ds = newds;
+	e->anchor = anchor;
+	e->next = before;
+	if (before == IPTC_EDIT_NONE) {
+		e->prev = edit->tails[anchor];
+		edit->tails[anchor] = j;
+	}
+	else {
+		e->prev = edit->entries[before].prev;
+		edit->entries[before].prev = j;
+	}
+	if (e->prev == IPTC_EDIT_NONE)
+		edit->heads[anchor] = j;
+	else
+		edit->entries[e->prev].next = j;
+
+	/* Appending is the common case, anything else renumbers the
+	 * group */
+	if (before == IPTC_EDIT_NONE)
+		e->rank = e->prev == IPTC_EDIT_NONE ? 1 :
+			edit->entries[e->prev].rank + 1;
+	else
+		for (k = edit->heads[anchor], rank = 1; k != IPTC_EDIT_NONE;
+				k = edit->entries[k].next)
+			edit->entries[k].rank = rank++;
+
+	/* Without the chains, searches fall back to scanning the
+	 * entries, which is slower but never fails */
+	if (edit->keys_valid && iptc_data_edit_key_link (edit, j) < 0)
+		edit->keys_valid = 0;
+
+	iptc_dataset_ref (newds);
+	newds->parent = edit->data;
+	newds->priv->flags |= IPTC_DATASET_PENDING;
+	newds->priv->pos = j;
+	return 0;
+}
+
+/**
+ * iptc_data_edit_add:
+ * @edit: batch of changes
+ * @newds: dataset to add
+ *
+ * Adds a dataset at the end of the collection being edited, which
+ * will hold a reference to it.  The dataset must not already be part
+ * of a collection.
+ *
+ * Returns: 0 on success, -1 on failure
+ */
+int
+iptc_data_edit_add (IptcDataEdit *edit, IptcDataSet *newds)
+{
+	if (!edit)
+		return -1;
+	return iptc_data_edit_insert (edit, newds, edit->count,
+			IPTC_EDIT_NONE);
+}
+
+/**
+ * iptc_data_edit_add_before:
+ * @edit: batch of changes
+ * @ds: dataset in the collection being edited, possibly one added
+ * through @edit
+ * @newds: dataset to add
+ *
+ * Adds a dataset just before @ds in the collection being edited.  See
+ * iptc_data_edit_add().
+ *
+ * Returns: 0 on success, -1 on failure
+ */
+int
+iptc_data_edit_add_before (IptcDataEdit *edit, IptcDataSet *ds,
+		IptcDataSet *newds)
+{
+	unsigned int pos;
+
+	switch (iptc_data_edit_locate (edit, ds, &pos)) {
+	case 1:
+		return iptc_data_edit_insert (edit, newds, pos,
+				IPTC_EDIT_NONE);
+	case 0:
+		return iptc_data_edit_insert (edit, newds,
+				edit->entries[pos].anchor, pos);
+	default:
+		return -1;
+	}
+}
+
+/**
+ * iptc_data_edit_add_after:
+ * @edit: batch of changes
+ * @ds: dataset in the collection being edited, possibly one added
+ * through @edit
+ * @newds: dataset to add
+ *
+ * Adds a dataset just after @ds in the collection being edited.  See
+ * iptc_data_edit_add().
+ *
+ * Returns: 0 on success, -1 on failure
+ */
+int
+iptc_data_edit_add_after (IptcDataEdit *edit, IptcDataSet *ds,
+		IptcDataSet *newds)
+{
+	unsigned int pos;
+
+	switch (iptc_data_edit_locate (edit, ds, &pos)) {
+	case 1:
+		return iptc_data_edit_insert (edit, newds, pos + 1,
+				edit->heads[pos + 1]);
+	case 0:
+		return iptc_data_edit_insert (edit, newds,
+				edit->entries[pos].anchor,
+				edit->entries[pos].next);
+	default:
+		return -1;
+	}
+}
+
+/**
+ * iptc_data_edit_remove:
+ * @edit: batch of changes
+ * @ds: dataset in the collection being edited, possibly one added
+ * through @edit
+ *
+ * Removes a dataset from the collection being edited.  A dataset of
+ * the original collection is only released when the edit is
+ * committed, one added through @edit immediately.
+ *
+ * Returns: 0 on success, -1 on failure
+ */
+int
+iptc_data_edit_remove (IptcDataEdit *edit, IptcDataSet *ds)
+{
+	IptcDataEditEntry *e;
+	unsigned int pos;
+
+	switch (iptc_data_edit_locate (edit, ds, &pos)) {
+	case 1:
+		edit->removed[pos] = 1;
+		return 0;
+	case 0:
+		e = edit->entries + pos;
+		if (e->prev == IPTC_EDIT_NONE)
+			edit->heads[e->anchor] = e->next;
+		else
+			edit->entries[e->prev].next = e->next;
+		if (e->next == IPTC_EDIT_NONE)
+			edit->tails[e->anchor] = e->prev;
+		else
+			edit->entries[e->next].prev = e->prev;
+		iptc_data_edit_key_unlink (edit, pos);
+		e->ds = NULL;
+
+		ds->parent = NULL;
+		ds->priv->flags &= ~IPTC_DATASET_PENDING;
+		iptc_dataset_unref (ds);
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+/**
+ * iptc_data_edit_replace:
+ * @edit: batch of changes
+ * @ds: dataset in the collection being edited, possibly one added
+ * through @edit
+ * @newds: dataset to take its place
+ *
+ * Replaces a dataset of the collection being edited with another one.
+ * This is the same as calling iptc_data_edit_add_before() followed by
+ * iptc_data_edit_remove().
+ *
+ * Returns: 0 on success, -1 on failure
+ */
+int
+iptc_data_edit_replace (IptcDataEdit *edit, IptcDataSet *ds,
+		IptcDataSet *newds)
+{
+	if (iptc_data_edit_add_before (edit, ds, newds) < 0)
+		return -1;
+	return iptc_data_edit_remove (edit, ds);
+}
+
+/**
+ * iptc_data_edit_get_next_dataset:
+ * @edit: batch of changes
+ * @ds: dataset after which to start the search, or NULL to start at
+ * the beginning
+ * @record: record number of the dataset to find
+ * @tag: tag number of the dataset to find
+ *
+ * Works like iptc_data_get_next_dataset(), but on the collection as it
+ * will be once @edit is committed, including the datasets added
+ * through @edit and not those removed.  The reference count of the
+ * returned dataset is incremented, so use iptc_dataset_unref() when
+ * finished with it.
+ *
+ * Like the collection, @edit keeps the datasets it adds chained by
+ * record:tag, and remembers where the last search for each one
+ * stopped, so that walking forward through the matches costs amortized
+ * constant time per call.  Only searches for a record above 9 or a tag
+ * above 255 scan the whole collection.
+ *
+ * Returns: pointer to the next matching dataset, NULL if there is none
+ */
+IptcDataSet *
+iptc_data_edit_get_next_dataset (IptcDataEdit *edit, IptcDataSet *ds,
+		IptcRecord record, IptcTag tag)
+{
+	IptcData *data;
+	IptcDataSet *orig = NULL, *found = NULL;
+	IptcDataEditKey *key = NULL;
+	unsigned int anchor = 0, rank = 0, best = IPTC_EDIT_NONE, pos, j;
+
+	if (!edit)
+		return NULL;
+	data = edit->data;
+
+	/* Datasets after (anchor, rank) are wanted, where the original
+	 * dataset at anchor follows all the entries of its group */
+	if (ds) {
+		switch (iptc_data_edit_locate (edit, ds, &pos)) {
+		case 1:
+			anchor = pos;
+			rank = IPTC_EDIT_NONE;
+			break;
+		case 0:
+			anchor = edit->entries[pos].anchor;
+			rank = edit->entries[pos].rank;
+			break;
+		default:
+			return NULL;
+		}
+	}
+
+	if (IPTC_INDEXED (record, tag)) {
+		if (!edit->keys_valid)
+			iptc_data_edit_key_build (edit);
+		if (edit->keys_valid)
+			key = edit->keys[record - 1] ?
+				edit->keys[record - 1] + tag : NULL;
+	}
+
+	/* First original dataset that qualifies, starting from where the
+	 * last search stopped if that is before it */
+	pos = rank == IPTC_EDIT_NONE ? anchor + 1 : anchor;
+	if (IPTC_INDEXED (record, tag) && data->priv->index_valid) {
+		IptcDataSet *last = NULL;
+
+		if (ds && rank == IPTC_EDIT_NONE && ds->record == record &&
+				ds->tag == tag)
+			orig = ds->priv->next;
+		else if (key && key->orig < pos &&
+				data->datasets[key->orig]->record == record &&
+				data->datasets[key->orig]->tag == tag)
+			orig = data->datasets[key->orig]->priv->next;
+		else
+			orig = data->priv->index[record - 1] ?
+				data->priv->index[record - 1][tag] : NULL;
+		for (; orig && (orig->priv->pos < pos ||
+				edit->removed[orig->priv->pos]);
+				orig = orig->priv->next)
+			last = orig;
+		if (key && last)
+			key->orig = last->priv->pos;
+	}
+	else {
+		for (; pos < edit->count; pos++) {
+			orig = data->datasets[pos];
+			if (!edit->removed[pos] && orig->record == record &&
+					orig->tag == tag)
+				break;
+		}
+		if (pos == edit->count)
+			orig = NULL;
+	}
+
+	/* First added dataset that qualifies */
+	if (key) {
+		if (ds && rank != IPTC_EDIT_NONE && ds->record == record &&
+				ds->tag == tag)
+			j = edit->entries[ds->priv->pos].key_next;
+		else if (key->entry != IPTC_EDIT_NONE &&
+				!IPTC_EDIT_AFTER (edit->entries + key->entry,
+					anchor, rank))
+			j = edit->entries[key->entry].key_next;
+		else
+			j = key->head;
+		for (; j != IPTC_EDIT_NONE &&
+				!IPTC_EDIT_AFTER (edit->entries + j, anchor, rank);
+				j = edit->entries[j].key_next)
+			key->entry = j;
+		best = j;
+	}
+	else if (!edit->keys_valid || !IPTC_INDEXED (record, tag)) {
+		for (j = 0; j < edit->n_entries; j++) {
+			IptcDataEditEntry *e = edit->entries + j;
+
+			if (!e->ds || e->ds->record != record ||
+					e->ds->tag != tag)
+				continue;
+			if (!IPTC_EDIT_AFTER (e, anchor, rank))
+				continue;
+			if (best == IPTC_EDIT_NONE ||
+					IPTC_EDIT_BEFORE (e,
+						edit->entries[best].anchor,
+						edit->entries[best].rank))
+				best = j;
+		}
+	}
+
+	if (best != IPTC_EDIT_NONE && (!orig ||
+			edit->entries[best].anchor <= orig->priv->pos))
+		found = edit->entries[best].ds;
+	else
+		found = orig;
+	if (found)
+		iptc_dataset_ref (found);
+	return found;
+}
+
+static void
+iptc_data_edit_free (IptcDataEdit *edit)
+{
+	IptcData *data = edit->data;
+	IptcMem *mem = data->priv->mem;
+	unsigned int i;
+
+	data->priv->edit = NULL;
+	for (i = 0; i < 9; i++)
+		iptc_mem_free (mem, edit->keys[i]);
+	iptc_mem_free (mem, edit->entries);
+	iptc_mem_free (mem, edit->heads);
+	iptc_mem_free (mem, edit->removed);
+	iptc_mem_free (mem, edit);
+	iptc_data_unref (data);
+}
+
+/**
+ * iptc_data_edit_commit:
+ * @edit: batch of changes
+ *
+ * Applies a batch of changes to the collection it was started on, and
+ * frees it.  The datasets of the collection are moved into their new
+ * order in one pass, whatever the number of changes.
+ *
+ * Returns: 0 on success, -1 on failure.  In the failure case, the
+ * collection is left unmodified, and @edit is freed as if
+ * iptc_data_edit_abort() had been called.
+ */
+int
+iptc_data_edit_commit (IptcDataEdit *edit)
+{
+	IptcData *data;
+	IptcDataSet **datasets;
+	unsigned int i, j, n, capacity;
+
+	if (!edit)
+		return -1;
+	data = edit->data;
+
+	for (i = 0, n = 0; i < edit->count; i++)
+		if (!edit->removed[i])
+			n++;
+	for (j = 0; j < edit->n_entries; j++)
+		if (edit->entries[j].ds)
+			n++;
+
+	capacity = n > data->priv->capacity ? n : data->priv->capacity;
+	datasets = NULL;
+	if (capacity) {
+		datasets = iptc_mem_alloc (data->priv->mem,
+				capacity * sizeof (IptcDataSet *));
+		if (!datasets) {
+			IPTC_LOG_NO_MEMORY (data->priv->log, "IptcData",
+				(int) (capacity * sizeof (IptcDataSet *)));
+			iptc_data_edit_abort (edit);
+			return -1;
+		}
+	}
+
+	/* The references held by the entries move to the array */
+	for (i = 0, n = 0; i <= edit->count; i++) {
+		for (j = edit->heads[i]; j != IPTC_EDIT_NONE;
+				j = edit->entries[j].next) {
+			IptcDataSet *ds = edit->entries[j].ds;
+
+			ds->priv->flags &= ~IPTC_DATASET_PENDING;
+			datasets[n++] = ds;
+		}
+		if (i == edit->count)
+			break;
+		if (edit->removed[i]) {
+			IptcDataSet *ds = data->datasets[i];
+
+			ds->parent = NULL;
+			ds->priv->next = NULL;
+			ds->priv->last = NULL;
+			iptc_dataset_unref (ds);
+		}
+		else
+			datasets[n++] = data->datasets[i];
+	}
+
+	iptc_mem_free (data->priv->mem, data->datasets);
+	data->datasets = datasets;
+	data->count = n;
+	data->priv->capacity = capacity;
+	iptc_data_index_build (data);
+	iptc_data_edit_free (edit);
+
+	return 0;
+}
+
+/**
+ * iptc_data_edit_abort:
+ * @edit: batch of changes
+ *
+ * Abandons a batch of changes, leaving the collection it was started
+ * on as it was, and frees it.  The datasets added through @edit are
+ * released.
+ */
+void
+iptc_data_edit_abort (IptcDataEdit *edit)
+{
+	unsigned int j;
+
+	if (!edit)
+		return;
+
+	for (j = 0; j < edit->n_entries; j++) {
+		IptcDataSet *ds = edit->entries[j].ds;
+
+		if (!ds)
+			continue;
+		ds->parent = NULL;
+		ds->priv->flags &= ~IPTC_DATASET_PENDING;
+		iptc_dataset_unref (ds);
+	}
+	iptc_data_edit_free (edit);
+}
+
 /**
  * iptc_data_log:
  * @data: collection for which the log object should be changed.
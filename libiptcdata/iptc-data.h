@@ -59,13 +59,47 @@ IptcData    *iptc_data_new_from_data (const unsigned char *buf,
 void         iptc_data_ref     (IptcData *data);
 void         iptc_data_unref   (IptcData *data);
 void         iptc_data_free    (IptcData *data);
+IptcData    *iptc_data_freeze  (IptcData *data);
+int          iptc_data_is_frozen (IptcData *data);
+IptcData    *iptc_data_clone   (IptcData *data);
 
 int          iptc_data_load (IptcData *data, const unsigned char *buf, 
 			       unsigned int size);
+typedef void (* IptcDestroyFunc) (void *user_data);
+int          iptc_data_load_borrowed (IptcData *data,
+			       const unsigned char *buf, unsigned int size,
+			       IptcDestroyFunc destroy, void *user_data);
+
+typedef enum {
+	IPTC_LOAD_BORROW	= 1 << 0,
+	IPTC_LOAD_KEEP_SKIPPED	= 1 << 1
+} IptcLoadFlags;
+
+int          iptc_data_load_filtered (IptcData *data,
+			       const unsigned char *buf, unsigned int size,
+			       const IptcTagFilter *filter,
+			       IptcLoadFlags flags,
+			       IptcDestroyFunc destroy, void *user_data);
+void         iptc_data_discard_skipped (IptcData *data);
+int          iptc_data_load_lazy (IptcData *data,
+			       const unsigned char *buf, unsigned int size,
+			       IptcDestroyFunc destroy, void *user_data);
+
+int          iptc_scan_stream (const unsigned char *buf, unsigned int size,
+			       unsigned int *count, unsigned int *payload);
+typedef int (* IptcParseFunc) (IptcRecord record, IptcTag tag,
+		const unsigned char *buf, unsigned int size, void *user_data);
+int          iptc_parse_stream (const unsigned char *buf, unsigned int size,
+			       IptcParseFunc func, void *user_data);
+
 int          iptc_data_save (IptcData *data, unsigned char **buf,
 			       unsigned int *size);
+unsigned int iptc_data_get_serialized_size (IptcData *data);
+int          iptc_data_save_to_buffer (IptcData *data, unsigned char *buf,
+			       unsigned int size);
 void         iptc_data_free_buf (IptcData *data, unsigned char *buf);
 			       
+int          iptc_data_reserve         (IptcData *data, unsigned int count);
 int          iptc_data_add_dataset     (IptcData *data, IptcDataSet *ds);
 int          iptc_data_add_dataset_before (IptcData *data, IptcDataSet *ds,
 						IptcDataSet *newds);
@@ -94,6 +128,49 @@ int iptc_data_add_dataset_with_contents (IptcData *data, IptcRecord record,
 		IptcTag tag, const unsigned char * buf,
 		unsigned int size, IptcValidate validate);
 
+typedef struct _IptcDataEdit IptcDataEdit;
+
+IptcDataEdit *iptc_data_edit_begin (IptcData *data);
+int          iptc_data_edit_add (IptcDataEdit *edit, IptcDataSet *newds);
+int          iptc_data_edit_add_before (IptcDataEdit *edit, IptcDataSet *ds,
+						IptcDataSet *newds);
+int          iptc_data_edit_add_after (IptcDataEdit *edit, IptcDataSet *ds,
+						IptcDataSet *newds);
+int          iptc_data_edit_remove (IptcDataEdit *edit, IptcDataSet *ds);
+int          iptc_data_edit_replace (IptcDataEdit *edit, IptcDataSet *ds,
+						IptcDataSet *newds);
+IptcDataSet *iptc_data_edit_get_next_dataset (IptcDataEdit *edit,
+		IptcDataSet *ds, IptcRecord record, IptcTag tag);
+int          iptc_data_edit_commit (IptcDataEdit *edit);
+void         iptc_data_edit_abort (IptcDataEdit *edit);
+
+typedef enum {
+	IPTC_VALIDATION_TOO_SHORT,	/* Smaller than the minimum size */
+	IPTC_VALIDATION_TOO_LONG,	/* Larger than the maximum size */
+	IPTC_VALIDATION_BAD_FORMAT,	/* Not a valid number, date or time */
+	IPTC_VALIDATION_MISSING,	/* Mandatory dataset not present */
+	IPTC_VALIDATION_REPEATED	/* Non-repeatable dataset repeated */
+} IptcValidationCode;
+
+typedef struct _IptcValidationProblem IptcValidationProblem;
+
+struct _IptcValidationProblem {
+	IptcValidationCode code;
+	IptcRecord	record;
+	IptcTag		tag;
+	int		index;	/* Position of the dataset, -1 if missing */
+};
+
+typedef struct _IptcValidationReport IptcValidationReport;
+
+struct _IptcValidationReport {
+	unsigned int	count;
+	IptcValidationProblem *problems;
+	unsigned int	max_problems;
+};
+
+int iptc_data_validate (IptcData *data, IptcValidationReport *report);
+
 void iptc_data_dump  (IptcData *data, unsigned int indent);
 void iptc_data_log  (IptcData *data, IptcLog *log);
 
@@ -20,6 +20,7 @@
 
 #include "config.h"
 #include "iptc-dataset.h"
+#include "iptc-private.h"
 #include "iptc-utils.h"
 #include "i18n.h"
 
@@ -30,12 +31,13 @@
 #undef  MIN
 #define MIN(a, b)  (((a) < (b)) ? (a) : (b))
 
-struct _IptcDataSetPrivate
-{
-	unsigned int ref_count;
-
-	IptcMem *mem;
-};
+/* Header in front of every payload owned by a dataset.  Clones made by
+ * iptc_data_clone() share payloads, which are freed when the last
+ * dataset using them releases them.  Since every setter replaces the
+ * payload instead of writing into it, sharing needs no copying. */
+typedef struct {
+	IptcAtomic ref_count;
+} IptcPayload;
 
 /**
  * iptc_dataset_new:
@@ -77,11 +79,12 @@ iptc_dataset_new_mem (IptcMem *mem)
 {
 	IptcDataSet *e = NULL;
 
-	e = iptc_mem_alloc (mem, sizeof (IptcDataSet));
+	/* The private part shares the allocation of the public struct */
+	e = iptc_mem_alloc (mem, sizeof (IptcDataSet) +
+			sizeof (IptcDataSetPrivate));
 	if (!e) return NULL;
-	e->priv = iptc_mem_alloc (mem, sizeof (IptcDataSetPrivate));
-	if (!e->priv) { iptc_mem_free (mem, e); return NULL; }
-	e->priv->ref_count = 1;
+	e->priv = (IptcDataSetPrivate *) (e + 1);
+	iptc_atomic_init (&e->priv->ref_count, 1);
 
 	e->priv->mem = mem;
 	iptc_mem_ref (mem);
@@ -111,6 +114,8 @@ iptc_dataset_copy (IptcDataSet *e)
 		return NULL;
 
 	copy = iptc_dataset_new_mem (e->priv->mem);
+	if (!copy)
+		return NULL;
 
 	copy->record = e->record;
 	copy->tag = e->tag;
@@ -121,6 +126,42 @@ iptc_dataset_copy (IptcDataSet *e)
 	return copy;
 }
 
+/* Like iptc_dataset_copy(), but the new dataset uses the same payload
+ * as @e, or the same borrowed buffer, until either sets a new value.
+ * The payloads of frozen datasets belong to their collection and are
+ * still copied. */
+IptcDataSet *
+iptc_dataset_share (IptcDataSet *e)
+{
+	IptcDataSet *copy;
+
+	if (!e)
+		return NULL;
+	if (e->priv->flags & IPTC_DATASET_FROZEN)
+		return iptc_dataset_copy (e);
+
+	copy = iptc_dataset_new_mem (e->priv->mem);
+	if (!copy)
+		return NULL;
+
+	copy->record = e->record;
+	copy->tag = e->tag;
+	copy->info = e->info;
+	if (e->data) {
+		if (e->priv->flags & IPTC_DATASET_BORROWED) {
+			copy->priv->flags |= IPTC_DATASET_BORROWED;
+			copy->priv->borrow = e->priv->borrow;
+			iptc_borrow_ref (copy->priv->borrow);
+		}
+		else
+			iptc_atomic_inc (&((IptcPayload *) e->data - 1)->ref_count);
+		copy->data = e->data;
+		copy->size = e->size;
+	}
+
+	return copy;
+}
+
 /**
  * iptc_dataset_ref:
  * @dataset: the referenced pointer
@@ -133,9 +174,9 @@ iptc_dataset_copy (IptcDataSet *e)
 void
 iptc_dataset_ref (IptcDataSet *e)
 {
-	if (!e) return;
+	if (!e || (e->priv->flags & IPTC_DATASET_FROZEN)) return;
 
-	e->priv->ref_count++;
+	iptc_atomic_inc (&e->priv->ref_count);
 }
 
 /**
@@ -151,13 +192,43 @@ iptc_dataset_ref (IptcDataSet *e)
 void
 iptc_dataset_unref (IptcDataSet *e)
 {
-	if (!e) return;
+	if (!e || (e->priv->flags & IPTC_DATASET_FROZEN)) return;
 
-	e->priv->ref_count--;
-	if (!e->priv->ref_count)
+	if (!iptc_atomic_dec (&e->priv->ref_count))
 		iptc_dataset_free (e);
 }
 
+static void
+iptc_dataset_release_data (IptcDataSet *e)
+{
+	if (e->data && !(e->priv->flags & IPTC_DATASET_BORROWED)) {
+		IptcPayload *p = (IptcPayload *) e->data - 1;
+
+		if (!iptc_atomic_dec (&p->ref_count))
+			iptc_mem_free (e->priv->mem, p);
+	}
+	iptc_borrow_unref (e->priv->borrow);
+	e->priv->borrow = NULL;
+	e->priv->flags &= ~IPTC_DATASET_BORROWED;
+	e->data = NULL;
+	e->size = 0;
+}
+
+/* Replaces the payload with a new one of @size bytes owned by @e */
+static unsigned char *
+iptc_dataset_alloc_data (IptcDataSet *e, unsigned int size)
+{
+	IptcPayload *p;
+
+	iptc_dataset_release_data (e);
+	p = iptc_mem_alloc (e->priv->mem, sizeof (IptcPayload) + size);
+	if (!p)
+		return NULL;
+	iptc_atomic_init (&p->ref_count, 1);
+	e->data = (unsigned char *) (p + 1);
+	return e->data;
+}
+
 /**
  * iptc_dataset_free:
  * @dataset: the object to free
@@ -170,13 +241,12 @@ iptc_dataset_unref (IptcDataSet *e)
 void
 iptc_dataset_free (IptcDataSet *e)
 {
-	if (!e) return;
+	if (!e || (e->priv && (e->priv->flags & IPTC_DATASET_FROZEN)))
+		return;
 
 	if (e->priv) {
 		IptcMem *mem = e->priv->mem;
-		if (e->data)
-			iptc_mem_free (mem, e->data);
-		iptc_mem_free (mem, e->priv);
+		iptc_dataset_release_data (e);
 		iptc_mem_free (mem, e);
 		iptc_mem_unref (mem);
 	}
@@ -197,12 +267,15 @@ iptc_dataset_free (IptcDataSet *e)
 void
 iptc_dataset_set_tag (IptcDataSet *e, IptcRecord record, IptcTag tag)
 {
-	if (!e)
+	if (!e || (e->priv->flags & IPTC_DATASET_FROZEN))
 		return;
 
 	e->record = record;
 	e->tag    = tag;
 	e->info   = iptc_tag_get_info (record, tag);
+
+	if (e->parent)
+		iptc_data_dataset_retagged (e->parent, e);
 }
 
 /**
@@ -231,7 +304,7 @@ int
 iptc_dataset_set_data (IptcDataSet *e, const unsigned char * buf, unsigned int size,
 		IptcValidate validate)
 {
-	if (!e || !buf || !size)
+	if (!e || (e->priv->flags & IPTC_DATASET_FROZEN) || !buf || !size)
 		return -1;
 
 	if (validate && e->info) {
@@ -239,18 +312,79 @@ iptc_dataset_set_data (IptcDataSet *e, const unsigned char * buf, unsigned int s
 			return 0;
 	}
 
-	if (e->data)
-		iptc_mem_free (e->priv->mem, e->data);
-
-	e->size = 0;
-	e->data = iptc_mem_alloc (e->priv->mem, size);
-	if (!e->data)
+	if (!iptc_dataset_alloc_data (e, size))
 		return -1;
 	memcpy (e->data, buf, size);
 	e->size = size;
 	return size;
 }
 
+/* Starts tracking a borrowed buffer, with a single reference owned by
+ * the caller.  @destroy is called with @user_data once the last
+ * reference is released. */
+IptcBorrow *
+iptc_borrow_new (IptcMem *mem, IptcDestroyFunc destroy, void *user_data)
+{
+	IptcBorrow *borrow;
+
+	if (!mem || !destroy)
+		return NULL;
+
+	borrow = iptc_mem_alloc (mem, sizeof (IptcBorrow));
+	if (!borrow)
+		return NULL;
+	iptc_atomic_init (&borrow->ref_count, 1);
+	borrow->mem = mem;
+	iptc_mem_ref (mem);
+	borrow->destroy = destroy;
+	borrow->user_data = user_data;
+
+	return borrow;
+}
+
+void
+iptc_borrow_ref (IptcBorrow *borrow)
+{
+	if (!borrow) return;
+	iptc_atomic_inc (&borrow->ref_count);
+}
+
+void
+iptc_borrow_unref (IptcBorrow *borrow)
+{
+	IptcMem *mem;
+
+	if (!borrow || iptc_atomic_dec (&borrow->ref_count))
+		return;
+
+	borrow->destroy (borrow->user_data);
+	mem = borrow->mem;
+	iptc_mem_free (mem, borrow);
+	iptc_mem_unref (mem);
+}
+
+/* Makes the payload of a dataset point directly at @buf instead of a
+ * private copy, taking a reference on @borrow if it is not NULL.
+ * Without it, the caller guarantees that @buf outlives the dataset
+ * or, at the latest, the next call that replaces the value, at which
+ * point the dataset goes back to owning its own memory. */
+int
+iptc_dataset_set_data_borrowed (IptcDataSet *e, const unsigned char * buf,
+		unsigned int size, IptcBorrow *borrow)
+{
+	if (!e || (e->priv->flags & IPTC_DATASET_FROZEN) || !buf || !size)
+		return -1;
+
+	iptc_dataset_release_data (e);
+
+	e->data = (unsigned char *) buf;
+	e->size = size;
+	e->priv->flags |= IPTC_DATASET_BORROWED;
+	e->priv->borrow = borrow;
+	iptc_borrow_ref (borrow);
+	return size;
+}
+
 /**
  * iptc_dataset_set_value:
  * @dataset: dataset for which the value should be set
@@ -275,7 +409,7 @@ iptc_dataset_set_value (IptcDataSet *e, unsigned int value,
 	IptcFormat format = IPTC_FORMAT_LONG;
 	int size;
 
-	if (!e)
+	if (!e || (e->priv->flags & IPTC_DATASET_FROZEN))
 		return -1;
 
 	if (e->info)
@@ -298,12 +432,7 @@ iptc_dataset_set_value (IptcDataSet *e, unsigned int value,
 			break;
 	}
 	
-	if (e->data)
-		iptc_mem_free (e->priv->mem, e->data);
-
-	e->size = 0;
-	e->data = iptc_mem_alloc (e->priv->mem, size);
-	if (!e->data)
+	if (!iptc_dataset_alloc_data (e, size))
 		return -1;
 	
 	e->size = size;
@@ -342,7 +471,7 @@ iptc_dataset_set_date (IptcDataSet *e, int year, int month, int day,
 {
 	char str[9];
 
-	if (!e)
+	if (!e || (e->priv->flags & IPTC_DATASET_FROZEN))
 		return -1;
 	if (year < 0 || month < 1 || day < 1)
 		return -1;
@@ -351,12 +480,7 @@ iptc_dataset_set_date (IptcDataSet *e, int year, int month, int day,
 	if (validate && e->info && e->info->format != IPTC_FORMAT_DATE)
 		return 0;
 
-	if (e->data)
-		iptc_mem_free (e->priv->mem, e->data);
-
-	e->size = 0;
-	e->data = iptc_mem_alloc (e->priv->mem, 8);
-	if (!e->data)
+	if (!iptc_dataset_alloc_data (e, 8))
 		return -1;
 	
 	e->size = 8;
@@ -389,7 +513,7 @@ iptc_dataset_set_time (IptcDataSet *e, int hour, int min, int sec, int tz,
 {
 	char str[12];
 
-	if (!e)
+	if (!e || (e->priv->flags & IPTC_DATASET_FROZEN))
 		return -1;
 	if (hour < 0 || min < 0 || sec < 0 || tz < -1439)
 		return -1;
@@ -398,12 +522,7 @@ iptc_dataset_set_time (IptcDataSet *e, int hour, int min, int sec, int tz,
 	if (validate && e->info && e->info->format != IPTC_FORMAT_TIME)
 		return 0;
 
-	if (e->data)
-		iptc_mem_free (e->priv->mem, e->data);
-
-	e->size = 0;
-	e->data = iptc_mem_alloc (e->priv->mem, 11);
-	if (!e->data)
+	if (!iptc_dataset_alloc_data (e, 11))
 		return -1;
 	
 	e->size = 11;
@@ -1,8 +1,24 @@
+/* For copy_file_range() */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <config.h>
 #include "iptc-jpeg.h"
 
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+#ifdef _WIN32
+#include <io.h>
+#endif
 
 #include "i18n.h"
 
@@ -23,6 +39,17 @@ typedef enum {
 #define JPEG_PS3_ID		"Photoshop 3.0"
 #define JPEG_BIM_ID		"8BIM"
 #define JPEG_BIM_IPTC_TYPE	0x0404
+/* Resource holding only zeros, reserving room for later in-place
+ * updates.  Its header takes 12 bytes. */
+#define JPEG_BIM_PAD_TYPE	0x0fa0
+#define JPEG_BIM_PAD_MIN	12
+
+/* Largest Photoshop 3.0 header that fits in one APP13 segment */
+#define JPEG_PS3_MAX		65533
+
+/* Largest amount of image data moved by one call when copying between
+ * file descriptors */
+#define JPEG_COPY_CHUNK		65536
 
 static int
 iptc_jpeg_seek_to_ps3 (FILE * infile, FILE * outfile, int abort_early)
@@ -40,11 +67,21 @@ iptc_jpeg_seek_to_ps3 (FILE * infile, FILE * outfile, int abort_early)
 				memmove (buf, buf+i, s-i);
 			s = s-i+(int)fread (buf+s-i, 1, sizeof(buf)-(s-i), infile);
 			i = 0;
+			if (s == 0)
+				return -1;
 		}
 		
 		switch (state) {
 		case IL_JPEG_SKIP_BYTES:
-			if (seek > s - i) {
+			if (seek > s - i && !outfile) {
+				/* Nothing to copy, so jump over the rest of the
+				 * segment instead of reading through it */
+				if (fseek (infile, seek - (s - i), SEEK_CUR) < 0)
+					return -1;
+				s = i = 0;
+				state = IL_JPEG_MARKER;
+			}
+			else if (seek > s - i) {
 				if (outfile)
 					if ((int)fwrite (buf + i, 1, s - i, outfile) < s-i)
 						return -1;
@@ -100,6 +137,52 @@ iptc_jpeg_seek_to_ps3 (FILE * infile, FILE * outfile, int abort_early)
 	return -1;
 }
 
+/* Called with @infile just after a segment of a Photoshop 3.0 header.
+ * If the header continues in the next segment, returns the size of the
+ * data of that segment, as iptc_jpeg_seek_to_ps3() does.  Otherwise
+ * returns 0.  The position of @infile is left unchanged. */
+static int
+iptc_jpeg_next_ps3 (FILE * infile)
+{
+	unsigned char buf[18];
+	int s, seek;
+
+	s = (int)fread (buf, 1, sizeof(buf), infile);
+	if (ferror (infile))
+		return -1;
+	if (fseek (infile, -s, SEEK_CUR) < 0)
+		return -1;
+	if (s < 18 || buf[0] != JPEG_MARKER || buf[1] != JPEG_MARKER_APP13 ||
+			memcmp (buf+4, JPEG_PS3_ID, 14))
+		return 0;
+
+	seek = iptc_get_short (buf+2, IPTC_BYTE_ORDER_MOTOROLA);
+	if (seek < 16)
+		return -1;
+	return seek - 2;
+}
+
+/* Skips over a Photoshop 3.0 header found by iptc_jpeg_seek_to_ps3(),
+ * including the segments it continues in.  @s is the size of the first
+ * segment.  Returns the size of the header as iptc_jpeg_read_ps3() would
+ * store it. */
+static int
+iptc_jpeg_skip_ps3 (FILE * infile, int s)
+{
+	int total = s;
+
+	if (fseek (infile, 4 + s, SEEK_CUR) < 0)
+		return -1;
+	while ((s = iptc_jpeg_next_ps3 (infile)) != 0) {
+		if (s < 0)
+			return -1;
+		if (fseek (infile, 4 + s, SEEK_CUR) < 0)
+			return -1;
+		total += s - 14;
+	}
+	return total;
+}
+
 static int
 iptc_jpeg_seek_to_end (FILE * infile, FILE * outfile)
 {
@@ -134,13 +217,18 @@ iptc_jpeg_seek_to_end (FILE * infile, FILE * outfile)
  * If a JPEG file contains IPTC metadata, the metadata is stored in one of the
  * Photoshop 3.0 records.
  *
+ * A header too large for one APP13 section is split across several
+ * consecutive ones.  The pieces are joined in @buf, which then holds the
+ * header as if it had been stored in a single section.  The size needed
+ * for @buf can be found beforehand with iptc_jpeg_get_ps3_size().
+ *
  * Returns: the number of bytes stored on success, 0 if the PS3 header was
  * not found, or -1 if an error occurred.
  */
 int
 iptc_jpeg_read_ps3 (FILE * infile, unsigned char * ps3, unsigned int size)
 {
-	int s;
+	int s, total;
 
 	if (!infile || !ps3)
 		return -1;
@@ -156,8 +244,110 @@ iptc_jpeg_read_ps3 (FILE * infile, unsigned char * ps3, unsigned int size)
 
 	if ((int)fread (ps3, 1, s, infile) < s)
 		return -1;
+	total = s;
 
-	return s;
+	/* Each continuation repeats the identifier, which is dropped */
+	while ((s = iptc_jpeg_next_ps3 (infile)) != 0) {
+		if (s < 0)
+			return -1;
+		if (fseek (infile, 4 + 14, SEEK_CUR) < 0)
+			return -1;
+		s -= 14;
+		if (size - total < (unsigned int) s)
+			return -1;
+		if ((int)fread (ps3 + total, 1, s, infile) < s)
+			return -1;
+		total += s;
+	}
+
+	return total;
+}
+
+/**
+ * iptc_jpeg_get_ps3_size:
+ * @infile: an open JPEG file with the current position set to the start of the file
+ *
+ * Scans the headers of a JPEG file looking for a "Photoshop 3.0" header,
+ * like iptc_jpeg_read_ps3(), and finds its size without reading it.  This
+ * is the size of the buffer needed by iptc_jpeg_read_ps3(), which can be
+ * called once @infile has been rewound.
+ *
+ * Returns: the size in bytes of the PS3 header, 0 if the PS3 header was
+ * not found, or -1 if an error occurred.
+ */
+int
+iptc_jpeg_get_ps3_size (FILE * infile)
+{
+	int s;
+
+	if (!infile)
+		return -1;
+
+	s = iptc_jpeg_seek_to_ps3 (infile, NULL, 0);
+	if (s <= 0)
+		return s;
+
+	return iptc_jpeg_skip_ps3 (infile, s);
+}
+
+/**
+ * iptc_jpeg_mem_find_ps3:
+ * @jpeg: the contents of a JPEG file, or at least all of its headers
+ * @len: size in bytes of @jpeg
+ * @offset: output parameter, the offset in @jpeg of the Photoshop 3.0 data
+ * @ps3_len: output parameter, the size in bytes of the Photoshop 3.0 data
+ *
+ * Scans the headers of a JPEG file held in memory, such as a mapped
+ * file, looking for a "Photoshop 3.0" header.  This is the same search
+ * as done by iptc_jpeg_read_ps3(), but nothing is read or copied: if
+ * the header is found, @jpeg + *@offset points to the same data that
+ * iptc_jpeg_read_ps3() would store, which can be passed directly to
+ * iptc_jpeg_ps3_find_iptc() and then to iptc_data_load_borrowed().
+ *
+ * A header split across several APP13 sections cannot be used in place,
+ * so only its first section is found.  Whether it continues can be told
+ * by looking for another "Photoshop 3.0" APP13 section at *@offset +
+ * *@ps3_len; iptc_jpeg_read_ps3() joins the sections together.
+ *
+ * Returns: 1 if the PS3 header was found, 0 if it was not found, or -1
+ * if @jpeg is not a JPEG file or ends before the first image data.
+ */
+int
+iptc_jpeg_mem_find_ps3 (const unsigned char * jpeg, size_t len,
+		size_t * offset, unsigned int * ps3_len)
+{
+	size_t i = 0;
+	unsigned int seek;
+
+	if (!jpeg || !offset || !ps3_len)
+		return -1;
+
+	while (len - i >= 2) {
+		if (jpeg[i] != JPEG_MARKER)
+			return -1;
+		if (jpeg[i+1] == JPEG_MARKER_SOI) {
+			i += 2;
+			continue;
+		}
+		if (jpeg[i+1] == JPEG_MARKER_SOS)
+			return 0;
+
+		if (len - i < 4)
+			return -1;
+		seek = iptc_get_short (jpeg+i+2, IPTC_BYTE_ORDER_MOTOROLA);
+		if (seek < 2 || len - i - 2 < seek)
+			return -1;
+		if (jpeg[i+1] == JPEG_MARKER_APP13 && seek >= 16 &&
+				!memcmp (jpeg+i+4, JPEG_PS3_ID, 14)) {
+			*offset = i + 4;
+			*ps3_len = seek - 2;
+			return 1;
+		}
+
+		/* Uninteresting header, skip it */
+		i += 2 + seek;
+	}
+	return -1;
 }
 
 /**
@@ -210,6 +400,43 @@ int iptc_jpeg_ps3_find_iptc (const unsigned char * ps3,
 	return 0;
 }
 
+static int
+iptc_jpeg_is_padding (unsigned short bim_type, const unsigned char * data,
+		unsigned int size)
+{
+	unsigned int i;
+
+	if (bim_type != JPEG_BIM_PAD_TYPE)
+		return 0;
+	for (i = 0; i < size; i++)
+		if (data[i])
+			return 0;
+	return 1;
+}
+
+/* Writes the header of a padding resource taking @pad bytes in all,
+ * which must be even and at least JPEG_BIM_PAD_MIN.  An odd size would
+ * leave a stray byte after the resource.  The caller fills in the zeros
+ * that follow it. */
+static int
+iptc_jpeg_write_pad_bim (unsigned char * buf, unsigned int pad)
+{
+	int j = 0;
+
+	memcpy (buf + j, JPEG_BIM_ID, 4);
+	j += 4;
+	iptc_set_short (buf + j, IPTC_BYTE_ORDER_MOTOROLA, JPEG_BIM_PAD_TYPE);
+	j += 2;
+	buf[j] = 0;
+	buf[j+1] = 0;
+	j += 2;
+	iptc_set_long (buf + j, IPTC_BYTE_ORDER_MOTOROLA,
+			pad - JPEG_BIM_PAD_MIN);
+	j += 4;
+
+	return j;
+}
+
 static int
 iptc_jpeg_write_iptc_bim (unsigned char * buf, const unsigned char * iptc,
 		unsigned int iptc_size)
@@ -252,7 +479,8 @@ iptc_jpeg_write_iptc_bim (unsigned char * buf, const unsigned char * iptc,
  * that header, and inserts the new IPTC data from @iptc.  Any other non-IPTC
  * portions of @ps3 are left unmodified.  If @ps3 is NULL, a blank PS3 header
  * is created.  If @iptc is NULL, the output PS3 header will contain no IPTC
- * data, even if @ps3 originally contained some.
+ * data, even if @ps3 originally contained some.  Padding added by
+ * iptc_jpeg_ps3_add_padding() or iptc_jpeg_update_in_place() is dropped.
  *
  * Returns: the number of bytes written to @buf; -1 on error.
  */
@@ -263,7 +491,7 @@ int iptc_jpeg_ps3_save_iptc (const unsigned char * ps3, unsigned int ps3_size,
 	unsigned int i, j, s;
 	unsigned short bim_type;
 	unsigned int bim_size;
-	int wrote_iptc = 0;
+	int wrote_iptc = 0, pad;
 
 	if (!buf)
 		return -1;
@@ -305,9 +533,12 @@ int iptc_jpeg_ps3_save_iptc (const unsigned char * ps3, unsigned int ps3_size,
 		i += 4;
 		if ((ps3_size - i) < bim_size)
 			return -1;
+		pad = iptc_jpeg_is_padding (bim_type, ps3 + i, bim_size);
 		bim_size += (bim_size & 1);
 		i += bim_size;
 
+		if (pad)
+			continue;
 		if (bim_type == JPEG_BIM_IPTC_TYPE && !wrote_iptc) {
 			if (!iptc)
 				continue;
@@ -328,33 +559,83 @@ int iptc_jpeg_ps3_save_iptc (const unsigned char * ps3, unsigned int ps3_size,
 }
 
 /**
- * iptc_jpeg_save_with_ps3:
- * @infile: the file stream from which the image data is copied
- * @outfile: the output file stream
- * @ps3: the Photoshop 3.0 header to add to the output file
+ * iptc_jpeg_ps3_add_padding:
+ * @ps3: a Photoshop 3.0 header, such as generated by iptc_jpeg_ps3_save_iptc()
  * @ps3_size: size in bytes of @ps3
+ * @size: size in bytes of the buffer holding @ps3
+ * @pad: the number of bytes to add
  *
- * Takes an existing JPEG file, @infile, removes any existing Photoshop
- * 3.0 header from it, and adds a new PS3 header, writing the output
- * to @outfile.  @infile must be open for reading and is expected to point
- * to the beginning of the JPEG file, which should be different from @outfile,
- * which must be open for writing.  If @ps3 is NULL, the output will contain
- * no PS3 header.  PS3 headers reside in the APP13 section of the JPEG file,
- * which is created if necessary.  All other headers and data will be copied
- * directly from @infile without modification.
+ * Appends a resource holding only zeros to @ps3, growing it by @pad
+ * bytes.  Saving a JPEG file with a padded header reserves room for
+ * the IPTC data to grow, so that later changes can be written with
+ * iptc_jpeg_update_in_place() instead of rewriting the whole file.  The
+ * padding resource needs 12 bytes, so @pad must be 0 or at least 12.
+ * Resources have an even size, so an odd @pad is rounded up by one.
  *
- * Returns: 0 on success, -1 on error.  Note that even in error, some data
- * may have been written to @outfile, and its contents should be considered
- * undefined.
+ * Returns: the new size of @ps3; -1 on error, including when the result
+ * would not fit in @size or in a single APP13 segment.
  */
 int
-iptc_jpeg_save_with_ps3 (FILE * infile, FILE * outfile,
-		const unsigned char * ps3, unsigned int ps3_size)
+iptc_jpeg_ps3_add_padding (unsigned char * ps3, unsigned int ps3_size,
+		unsigned int size, unsigned int pad)
 {
-	int s;
+	unsigned int j;
 
-	if (!infile || !outfile)
+	if (!ps3 || ps3_size < 14 || ps3_size > size ||
+			ps3_size > JPEG_PS3_MAX)
 		return -1;
+	if (pad == 0)
+		return ps3_size;
+	if (pad < JPEG_BIM_PAD_MIN)
+		return -1;
+	pad += pad & 1;
+	if (pad > size - ps3_size ||
+			pad > JPEG_PS3_MAX - ps3_size)
+		return -1;
+
+	j = ps3_size + iptc_jpeg_write_pad_bim (ps3 + ps3_size, pad);
+	memset (ps3 + j, 0, ps3_size + pad - j);
+	return ps3_size + pad;
+}
+
+/* Writes @ps3 in an APP13 segment, or in several consecutive ones if it
+ * is too large for one, repeating the identifier at the start of each */
+static int
+iptc_jpeg_write_ps3 (FILE * outfile, const unsigned char * ps3,
+		unsigned int ps3_size)
+{
+	unsigned char buf[4];
+	unsigned int n, head = 0;
+
+	if (ps3_size > JPEG_PS3_MAX &&
+			(ps3_size < 14 || memcmp (ps3, JPEG_PS3_ID, 14)))
+		return -1;
+
+	do {
+		n = ps3_size < JPEG_PS3_MAX - head ?
+			ps3_size : JPEG_PS3_MAX - head;
+		buf[0] = JPEG_MARKER;
+		buf[1] = JPEG_MARKER_APP13;
+		iptc_set_short (buf+2, IPTC_BYTE_ORDER_MOTOROLA, head + n + 2);
+		if (fwrite (buf, 1, 4, outfile) < 4)
+			return -1;
+		if (head && fwrite (JPEG_PS3_ID, 1, head, outfile) < head)
+			return -1;
+		if (fwrite (ps3, 1, n, outfile) < n)
+			return -1;
+		ps3 += n;
+		ps3_size -= n;
+		head = 14;
+	} while (ps3_size > 0);
+
+	return 0;
+}
+
+static int
+iptc_jpeg_save_headers (FILE * infile, FILE * outfile,
+		const unsigned char * ps3, unsigned int ps3_size)
+{
+	int s;
 
 	/* Copy infile to outfile until we encounter the previous PS3
 	 * block, or the right place for the new PS3 block, whichever
@@ -365,19 +646,13 @@ iptc_jpeg_save_with_ps3 (FILE * infile, FILE * outfile,
 
 	/* Insert the new PS3 block */
 	if (ps3) {
-		unsigned char buf[4];
-		buf[0] = JPEG_MARKER;
-		buf[1] = JPEG_MARKER_APP13;
-		iptc_set_short (buf+2, IPTC_BYTE_ORDER_MOTOROLA, ps3_size + 2);
-		if (fwrite (buf, 1, 4, outfile) < 4)
-			return -1;
-		if (fwrite (ps3, 1, ps3_size, outfile) < ps3_size)
+		if (iptc_jpeg_write_ps3 (outfile, ps3, ps3_size) < 0)
 			return -1;
 	}
 
 	if (s > 0) {
 		/* Skip over the old PS3 block if we've come upon it. */
-		if (fseek (infile, 4 + s, SEEK_CUR) < 0)
+		if (iptc_jpeg_skip_ps3 (infile, s) < 0)
 			return -1;
 	}
 	else {
@@ -387,11 +662,44 @@ iptc_jpeg_save_with_ps3 (FILE * infile, FILE * outfile,
 		if (s < 0)
 			return -1;
 		if (s > 0) {
-			if (fseek (infile, 4 + s, SEEK_CUR) < 0)
+			if (iptc_jpeg_skip_ps3 (infile, s) < 0)
 				return -1;
 		}
 	}
 
+	return 0;
+}
+
+/**
+ * iptc_jpeg_save_with_ps3:
+ * @infile: the file stream from which the image data is copied
+ * @outfile: the output file stream
+ * @ps3: the Photoshop 3.0 header to add to the output file
+ * @ps3_size: size in bytes of @ps3
+ *
+ * Takes an existing JPEG file, @infile, removes any existing Photoshop
+ * 3.0 header from it, and adds a new PS3 header, writing the output
+ * to @outfile.  @infile must be open for reading and is expected to point
+ * to the beginning of the JPEG file, which should be different from @outfile,
+ * which must be open for writing.  If @ps3 is NULL, the output will contain
+ * no PS3 header.  PS3 headers reside in the APP13 section of the JPEG file,
+ * which is created if necessary.  All other headers and data will be copied
+ * directly from @infile without modification.
+ *
+ * Returns: 0 on success, -1 on error.  Note that even in error, some data
+ * may have been written to @outfile, and its contents should be considered
+ * undefined.
+ */
+int
+iptc_jpeg_save_with_ps3 (FILE * infile, FILE * outfile,
+		const unsigned char * ps3, unsigned int ps3_size)
+{
+	if (!infile || !outfile)
+		return -1;
+
+	if (iptc_jpeg_save_headers (infile, outfile, ps3, ps3_size) < 0)
+		return -1;
+
 	/* Copy the remainder of the file */
 	if (iptc_jpeg_seek_to_end (infile, outfile) < 0)
 		return -1;
@@ -399,93 +707,227 @@ iptc_jpeg_save_with_ps3 (FILE * infile, FILE * outfile,
 	return 0;
 }
 
-
-
-#if 0
+/* Copies everything from the current position of @infd to the current
+ * position of @outfd, letting the kernel move the data where it can. */
 static int
-iptc_loader_jpeg_search (IptcLoader *ild, unsigned char *buf, unsigned int len)
+iptc_jpeg_copy_fd (int infd, int outfd)
 {
-	IptcJpegInfo * jpeg = &ild->type_info.jpeg;
-	int i=0;
-	while (len - i >= 18) { 
-		switch (jpeg->state) {
-		case IL_JPEG_SKIP_BYTES:
-			if (jpeg->seek > (len - i)) {
-				jpeg->seek -= len-i;
-				i = len;
-			}
-			else {
-				jpeg->state = jpeg->next_state;
-				i += jpeg->seek;
-			}
+	unsigned char *buf;
+	int s, w;
+
+#ifdef HAVE_COPY_FILE_RANGE
+	while (1) {
+		ssize_t n = copy_file_range (infd, NULL, outfd, NULL,
+				JPEG_COPY_CHUNK, 0);
+		if (n > 0)
+			continue;
+		if (n == 0)
+			return 0;
+		if (errno == EINTR)
+			continue;
+		/* Not supported for these files, try the next way.  The
+		 * file offsets have advanced by whatever was copied. */
+		if (errno == ENOSYS || errno == EXDEV || errno == EINVAL ||
+				errno == EOPNOTSUPP || errno == EBADF)
 			break;
-			
-		case IL_JPEG_MARKER:
-			if (buf[i] != 0xff)
-				return -1;
-			if (buf[i+1] == JPEG_MARKER_SOI) {
-				i += 2;
-			}
-			else if (buf[i+1] == JPEG_MARKER_APP13 &&
-					!memcmp(buf+i+4, JPEG_PS3_ID, 14)) {
-				jpeg->state = IL_JPEG_IN_APP13;
-				jpeg->app13_size = iptc_get_short(buf+i+2,
-						IPTC_BYTE_ORDER_MOTOROLA);
-				jpeg->app13_size -= 16;
-				i += 18;
-			}
-			else if (buf[i+1] >= JPEG_MARKER_APP0 &&
-					buf[i+1] <= JPEG_MARKER_APP15) {
-				jpeg->state = IL_JPEG_SKIP_BYTES;
-				jpeg->next_state = IL_JPEG_MARKER;
-				jpeg->seek = iptc_get_short(buf+i+2,
-						IPTC_BYTE_ORDER_MOTOROLA);
-				i += 2;
-			}
-			else {
-				ild->state = IL_FAILED;
-				return i;
-			}
+		return -1;
+	}
+#endif
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)
+	while (1) {
+		ssize_t n = sendfile (outfd, infd, NULL, JPEG_COPY_CHUNK);
+		if (n > 0)
+			continue;
+		if (n == 0)
+			return 0;
+		if (errno == EINTR)
+			continue;
+		if (errno == ENOSYS || errno == EINVAL)
 			break;
+		return -1;
+	}
+#endif
 
-		case IL_JPEG_IN_APP13:
-			if (jpeg->app13_size < 14 ||
-					memcmp(buf+i, JPEG_BIM_ID, 4)) {
-				ild->state = IL_FAILED;
-				return i;
+	buf = malloc (JPEG_COPY_CHUNK);
+	if (!buf)
+		return -1;
+	while ((s = (int)read (infd, buf, JPEG_COPY_CHUNK)) != 0) {
+		if (s < 0) {
+			if (errno == EINTR)
+				continue;
+			goto failure;
+		}
+		for (w = 0; w < s; ) {
+			int n = (int)write (outfd, buf + w, s - w);
+			if (n < 0) {
+				if (errno == EINTR)
+					continue;
+				goto failure;
 			}
-			jpeg->bim_type = iptc_get_short(buf+i+4,
-					IPTC_BYTE_ORDER_MOTOROLA);
-			jpeg->seek = buf[i+6] + 1;
-			jpeg->seek += (jpeg->seek & 1);
-			jpeg->state = IL_JPEG_SKIP_BYTES;
-			jpeg->next_state = IL_JPEG_BIM_DATA;
-			i += 6;
-			jpeg->app13_size -= 6 + jpeg->seek;
-			break;
+			w += n;
+		}
+	}
+	free (buf);
+	return 0;
 
-		case IL_JPEG_BIM_DATA:
-			jpeg->seek = iptc_get_long(buf+i,
-					IPTC_BYTE_ORDER_MOTOROLA);
-			i += 4;
-			if (jpeg->bim_type == JPEG_BIM_IPTC_TYPE) {
-				jpeg->iptc_location = IL_IPTC_APP13;
-				ild->size = jpeg->seek;
-				ild->state = IL_IPTC_FOUND;
-				return i;
-			}
-			jpeg->seek += (jpeg->seek & 1);
-			jpeg->state = IL_JPEG_SKIP_BYTES;
-			jpeg->next_state = IL_JPEG_IN_APP13;
-			jpeg->app13_size -= 4 + jpeg->seek;
-			break;
+failure:
+	free (buf);
+	return -1;
+}
+
+/**
+ * iptc_jpeg_save_with_ps3_fd:
+ * @infd: the file descriptor from which the image data is copied
+ * @outfd: the output file descriptor
+ * @ps3: the Photoshop 3.0 header to add to the output file
+ * @ps3_size: size in bytes of @ps3
+ *
+ * Works like iptc_jpeg_save_with_ps3(), but on file descriptors.  @infd
+ * must be open for reading and positioned at the beginning of the JPEG
+ * file, and @outfd must be open for writing.  Once the headers have been
+ * written, the image data that follows them is copied without passing
+ * through stdio, using copy_file_range() or sendfile() where the system
+ * supports them, which is much faster for large images.
+ *
+ * On return, the file offsets of both descriptors are left at the end of
+ * the data read and written.
+ *
+ * Returns: 0 on success, -1 on error.  Note that even in error, some data
+ * may have been written to @outfd, and its contents should be considered
+ * undefined.
+ */
+int
+iptc_jpeg_save_with_ps3_fd (int infd, int outfd,
+		const unsigned char * ps3, unsigned int ps3_size)
+{
+	FILE *infile = NULL, *outfile = NULL;
+	long pos = -1;
+	int fd;
+
+	if (infd < 0 || outfd < 0)
+		return -1;
+
+	/* The headers are parsed with stdio on duplicates of the
+	 * descriptors, which share their file offsets. */
+	fd = dup (infd);
+	if (fd < 0)
+		return -1;
+	infile = fdopen (fd, "rb");
+	if (!infile) {
+		close (fd);
+		return -1;
+	}
+	fd = dup (outfd);
+	if (fd < 0)
+		goto failure;
+	outfile = fdopen (fd, "wb");
+	if (!outfile) {
+		close (fd);
+		goto failure;
+	}
+
+	if (iptc_jpeg_save_headers (infile, outfile, ps3, ps3_size) < 0)
+		goto failure;
+	pos = ftell (infile);
+	if (pos < 0)
+		goto failure;
+	if (fclose (outfile) != 0) {
+		outfile = NULL;
+		goto failure;
+	}
+	fclose (infile);
+
+	/* stdio has read ahead of the headers, so go back to the
+	 * end of what was used. */
+	if (lseek (infd, pos, SEEK_SET) < 0)
+		return -1;
+
+	return iptc_jpeg_copy_fd (infd, outfd);
+
+failure:
+	if (outfile)
+		fclose (outfile);
+	fclose (infile);
+	return -1;
+}
+
+
+/**
+ * iptc_jpeg_update_in_place:
+ * @file: a JPEG file open for reading and writing, with the current
+ * position set to the start of the file
+ * @ps3: the Photoshop 3.0 header to store in the file
+ * @ps3_size: size in bytes of @ps3
+ *
+ * Replaces the Photoshop 3.0 header of a JPEG file without rewriting
+ * the rest of the file.  This is only possible if @file already has a
+ * PS3 header and @ps3 fits in its APP13 section: @ps3 is written over
+ * the old header, and the space left over, if any, is filled with a
+ * padding resource.  A header split across several APP13 sections is
+ * never updated in place.  The padding resource takes at least 12
+ * bytes and has an even size, so @ps3 must either be the same size as
+ * the old header or leave an even number of bytes, at least 12, for
+ * it.  iptc_jpeg_ps3_add_padding() can reserve space for this when the
+ * file is first saved.
+ *
+ * When this function returns 0, @file has not been modified and the
+ * header must be saved with iptc_jpeg_save_with_ps3() instead.
+ *
+ * Returns: 1 if the header was updated, 0 if it does not fit or @file
+ * has no PS3 header, or -1 on error.  Note that in error, the PS3
+ * header of @file may have been partially written.
+ */
+int
+iptc_jpeg_update_in_place (FILE * file, const unsigned char * ps3,
+		unsigned int ps3_size)
+{
+	static const unsigned char zeros[256];
+	unsigned char buf[JPEG_BIM_PAD_MIN];
+	unsigned int pad, n;
+	int s, next;
 
+	if (!file || !ps3 || ps3_size < 14)
+		return -1;
+	if (memcmp (ps3, JPEG_PS3_ID, 14))
+		return -1;
+
+	s = iptc_jpeg_seek_to_ps3 (file, NULL, 0);
+	if (s <= 0)
+		return s;
+	if ((unsigned int) s < ps3_size)
+		return 0;
+	pad = s - ps3_size;
+	if (pad > 0 && (pad < JPEG_BIM_PAD_MIN || (pad & 1)))
+		return 0;
+
+	/* A header split across several segments is left alone */
+	if (fseek (file, 4 + s, SEEK_CUR) < 0)
+		return -1;
+	next = iptc_jpeg_next_ps3 (file);
+	if (next != 0)
+		return next < 0 ? -1 : 0;
+
+	/* Also needed to switch the stream from reading to writing */
+	if (fseek (file, -s, SEEK_CUR) < 0)
+		return -1;
+	if (fwrite (ps3, 1, ps3_size, file) < ps3_size)
+		return -1;
+	if (pad) {
+		n = iptc_jpeg_write_pad_bim (buf, pad);
+		if (fwrite (buf, 1, n, file) < n)
+			return -1;
+		for (pad -= n; pad > 0; pad -= n) {
+			n = pad < sizeof(zeros) ? pad : sizeof(zeros);
+			if (fwrite (zeros, 1, n, file) < n)
+				return -1;
 		}
 	}
+	if (fflush (file) != 0)
+		return -1;
 
-	return i;
+	return 1;
 }
-#endif
+
 
 /*
 	retval = -1;
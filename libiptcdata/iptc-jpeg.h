@@ -29,14 +29,23 @@ extern "C" {
 #include <libiptcdata/iptc-data.h>
 
 int iptc_jpeg_read_ps3 (FILE * infile, unsigned char * buf, unsigned int size);
+int iptc_jpeg_get_ps3_size (FILE * infile);
+int iptc_jpeg_mem_find_ps3 (const unsigned char * jpeg, size_t len,
+		size_t * offset, unsigned int * ps3_len);
 int iptc_jpeg_ps3_find_iptc (const unsigned char * ps3,
 		unsigned int ps3_size, unsigned int * iptc_len);
 
 int iptc_jpeg_ps3_save_iptc (const unsigned char * ps3, unsigned int ps3_size,
 		const unsigned char * iptc, unsigned int iptc_size,
 		unsigned char * buf, unsigned int size);
+int iptc_jpeg_ps3_add_padding (unsigned char * ps3, unsigned int ps3_size,
+		unsigned int size, unsigned int pad);
 int iptc_jpeg_save_with_ps3 (FILE * infile, FILE * outfile,
 		const unsigned char * ps3, unsigned int ps3_size);
+int iptc_jpeg_save_with_ps3_fd (int infd, int outfd,
+		const unsigned char * ps3, unsigned int ps3_size);
+int iptc_jpeg_update_in_place (FILE * file,
+		const unsigned char * ps3, unsigned int ps3_size);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,650 @@
+/* iptc-loader.c
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <config.h>
+#include "iptc-loader.h"
+#include "iptc-utils.h"
+#include "iptc-atomic.h"
+
+#include <string.h>
+
+#define JPEG_MARKER		0xff
+#define JPEG_MARKER_TEM		0x01
+#define JPEG_MARKER_RST0	0xd0
+#define JPEG_MARKER_RST7	0xd7
+#define JPEG_MARKER_SOI		0xd8
+#define JPEG_MARKER_EOI		0xd9
+#define JPEG_MARKER_SOS		0xda
+#define JPEG_MARKER_APP13	0xed
+
+#define JPEG_PS3_ID		"Photoshop 3.0"
+#define JPEG_BIM_ID		"8BIM"
+#define JPEG_BIM_IPTC_TYPE	0x0404
+
+/* Largest IPTC resource accepted, far beyond anything seen in practice */
+#define IPTC_LOADER_MAX_SIZE	(16 * 1024 * 1024)
+
+typedef enum {
+	IL_MARKER,		/* 0xff and the marker byte */
+	IL_LENGTH,		/* length of the segment */
+	IL_SKIP,		/* bytes we are not interested in */
+	IL_PS3_ID,		/* "Photoshop 3.0" at the start of APP13 */
+	IL_BIM_HEADER,		/* "8BIM", type and name length */
+	IL_BIM_SIZE,		/* size of the resource data */
+	IL_BIM_PAD,		/* pad byte after odd sized resource data */
+	IL_IPTC_DATA,		/* contents of the IPTC resource */
+	IL_PS3_NEXT		/* marker after the end of an APP13 segment */
+} IptcLoaderState;
+
+struct _IptcLoader {
+	IptcAtomic ref_count;
+
+	IptcLoaderStatus status;
+	IptcLoaderState state;
+	IptcLoaderState next_state;
+
+	/* Header bytes collected so far for the current state, which
+	 * may have been split across several calls to
+	 * iptc_loader_write(). */
+	unsigned char hdr[14];
+	unsigned int hdr_len;
+
+	unsigned char marker;
+	unsigned int skip;
+
+	/* Bytes of the current APP13 segment not yet accounted for,
+	 * counted while in_ps3 is set */
+	unsigned int seg_left;
+	int in_ps3;
+	unsigned short bim_type;
+
+	/* A Photoshop 3.0 header too large for one segment goes on in
+	 * the next one.  While cont is set, the following segment is
+	 * being checked, and the state and header bytes collected so
+	 * far are saved to resume there. */
+	int cont;
+	IptcLoaderState resume;
+	unsigned char saved[7];
+	unsigned int saved_len;
+
+	/* The IPTC data, of iptc_size bytes according to its resource
+	 * header.  Only iptc_alloc bytes are allocated, grown as the
+	 * segments holding the data arrive, so that a bogus size cannot
+	 * make the loader allocate more than it has received. */
+	unsigned char *iptc;
+	unsigned int iptc_size;
+	unsigned int iptc_len;
+	unsigned int iptc_alloc;
+
+	IptcMem *mem;
+};
+
+/**
+ * iptc_loader_new:
+ *
+ * Allocates a new loader for extracting IPTC data from a JPEG file
+ * that is delivered in pieces, for example as it is received from the
+ * network.  The default memory allocation functions (malloc, etc.) are
+ * used.  If you need custom memory management functions, use
+ * iptc_loader_new_mem() instead.  This allocation will set the
+ * #IptcLoader refcount to 1, so use iptc_loader_unref() when finished
+ * with the pointer.
+ *
+ * Returns: pointer to the new #IptcLoader object, NULL on error
+ */
+IptcLoader *
+iptc_loader_new (void)
+{
+	IptcMem *mem = iptc_mem_new_default ();
+	IptcLoader *loader = iptc_loader_new_mem (mem);
+
+	iptc_mem_unref (mem);
+
+	return loader;
+}
+
+/**
+ * iptc_loader_new_mem:
+ * @mem: Pointer to an #IptcMem object that defines custom memory managment
+ * functions.  The refcount of @mem will be incremented.  It is decremented
+ * when the returned #IptcLoader object is freed.
+ *
+ * Allocates a new loader using custom memory management functions.
+ * This allocation will set the #IptcLoader refcount to 1, so use
+ * iptc_loader_unref() when finished with the object.
+ *
+ * Returns: pointer to the new #IptcLoader object, NULL on error
+ */
+IptcLoader *
+iptc_loader_new_mem (IptcMem *mem)
+{
+	IptcLoader *loader;
+
+	if (!mem) return NULL;
+
+	loader = iptc_mem_alloc (mem, sizeof (IptcLoader));
+	if (!loader)
+		return NULL;
+	iptc_atomic_init (&loader->ref_count, 1);
+
+	loader->mem = mem;
+	iptc_mem_ref (mem);
+
+	iptc_loader_reset (loader);
+
+	return loader;
+}
+
+/**
+ * iptc_loader_ref:
+ * @loader: the referenced pointer
+ *
+ * Increments the reference count of an #IptcLoader object.  This function
+ * should be called whenever a copy of a pointer is made by the application.
+ * iptc_loader_unref() can then be used when the pointer is no longer needed
+ * to ensure that the object is freed once the object is completely unused.
+ */
+void
+iptc_loader_ref (IptcLoader *loader)
+{
+	if (!loader) return;
+	iptc_atomic_inc (&loader->ref_count);
+}
+
+/**
+ * iptc_loader_unref:
+ * @loader: the unreferenced pointer
+ *
+ * Decrements the reference count of an #IptcLoader object.  The object
+ * will automatically be freed when the count reaches 0.  This function
+ * should be called whenever a pointer is no longer needed by an
+ * application.
+ */
+void
+iptc_loader_unref (IptcLoader *loader)
+{
+	if (!loader) return;
+	if (!iptc_atomic_dec (&loader->ref_count)) iptc_loader_free (loader);
+}
+
+/**
+ * iptc_loader_free:
+ * @loader: the object to free
+ *
+ * Frees an #IptcLoader object, irrespective of its refcount.  This
+ * function should only be used internally.  Use iptc_loader_unref()
+ * instead.
+ */
+void
+iptc_loader_free (IptcLoader *loader)
+{
+	IptcMem *mem;
+
+	if (!loader) return;
+
+	mem = loader->mem;
+	iptc_mem_free (mem, loader->iptc);
+	iptc_mem_free (mem, loader);
+	iptc_mem_unref (mem);
+}
+
+/**
+ * iptc_loader_reset:
+ * @loader: the loader to reset
+ *
+ * Discards everything that has been written to @loader so that it can
+ * be used to scan another file.
+ */
+void
+iptc_loader_reset (IptcLoader *loader)
+{
+	if (!loader) return;
+
+	iptc_mem_free (loader->mem, loader->iptc);
+	loader->iptc = NULL;
+	loader->iptc_size = 0;
+	loader->iptc_len = 0;
+	loader->iptc_alloc = 0;
+
+	loader->status = IPTC_LOADER_NEED_MORE;
+	loader->state = IL_MARKER;
+	loader->hdr_len = 0;
+	loader->skip = 0;
+	loader->seg_left = 0;
+	loader->in_ps3 = 0;
+	loader->cont = 0;
+	loader->saved_len = 0;
+}
+
+static unsigned int
+iptc_loader_header_size (IptcLoaderState state)
+{
+	switch (state) {
+	case IL_MARKER:
+	case IL_LENGTH:
+	case IL_PS3_NEXT:
+		return 2;
+	case IL_BIM_PAD:
+		return 1;
+	case IL_PS3_ID:
+		return 14;
+	case IL_BIM_HEADER:
+		return 7;
+	case IL_BIM_SIZE:
+		return 4;
+	default:
+		return 0;
+	}
+}
+
+static void
+iptc_loader_skip (IptcLoader *loader, unsigned int n, IptcLoaderState next)
+{
+	if (n) {
+		loader->skip = n;
+		loader->state = IL_SKIP;
+		loader->next_state = next;
+	}
+	else
+		loader->state = next;
+}
+
+/* Whether an APP13 segment ended between two resources, so that the
+ * Photoshop 3.0 header may end there too.  The pad byte of the last
+ * resource may be omitted. */
+static int
+iptc_loader_at_boundary (IptcLoader *loader)
+{
+	return loader->saved_len == 0 && (loader->resume == IL_BIM_HEADER ||
+			loader->resume == IL_BIM_PAD);
+}
+
+/* Gives up on continuing the Photoshop 3.0 header in the segment being
+ * checked, which is an error unless it could end where it did */
+static int
+iptc_loader_end_ps3 (IptcLoader *loader)
+{
+	if (!loader->cont)
+		return 0;
+	loader->cont = 0;
+	if (!iptc_loader_at_boundary (loader)) {
+		loader->status = IPTC_LOADER_ERROR;
+		return -1;
+	}
+	loader->saved_len = 0;
+	return 0;
+}
+
+/* Acts on a complete header that has been collected in loader->hdr */
+static void
+iptc_loader_process (IptcLoader *loader)
+{
+	const unsigned char *hdr = loader->hdr;
+	unsigned int len, s;
+
+	switch (loader->state) {
+	case IL_MARKER:
+		if (hdr[0] != JPEG_MARKER) {
+			loader->status = IPTC_LOADER_ERROR;
+			break;
+		}
+		if (hdr[1] == JPEG_MARKER) {
+			/* Fill byte, the marker is still to come */
+			loader->hdr_len = 1;
+			break;
+		}
+		if (hdr[1] == JPEG_MARKER_SOS || hdr[1] == JPEG_MARKER_EOI) {
+			/* No more headers to search */
+			loader->status = IPTC_LOADER_NOT_FOUND;
+			break;
+		}
+		if (hdr[1] == JPEG_MARKER_SOI || hdr[1] == JPEG_MARKER_TEM ||
+				(hdr[1] >= JPEG_MARKER_RST0 &&
+				 hdr[1] <= JPEG_MARKER_RST7)) {
+			/* Markers without a segment */
+			break;
+		}
+		loader->marker = hdr[1];
+		loader->state = IL_LENGTH;
+		break;
+
+	case IL_LENGTH:
+		len = iptc_get_short (hdr, IPTC_BYTE_ORDER_MOTOROLA);
+		if (len < 2) {
+			loader->status = IPTC_LOADER_ERROR;
+			break;
+		}
+		len -= 2;
+		if (loader->marker == JPEG_MARKER_APP13 &&
+				len >= iptc_loader_header_size (IL_PS3_ID)) {
+			loader->seg_left = len;
+			loader->state = IL_PS3_ID;
+		}
+		else if (iptc_loader_end_ps3 (loader) == 0)
+			iptc_loader_skip (loader, len, IL_MARKER);
+		break;
+
+	case IL_PS3_ID:
+		loader->seg_left -= 14;
+		if (memcmp (hdr, JPEG_PS3_ID, 14)) {
+			/* Some other kind of APP13 segment */
+			if (iptc_loader_end_ps3 (loader) < 0)
+				break;
+			iptc_loader_skip (loader, loader->seg_left, IL_MARKER);
+			loader->seg_left = 0;
+			break;
+		}
+		loader->in_ps3 = 1;
+		if (loader->cont) {
+			/* Resume where the previous segment stopped */
+			loader->cont = 0;
+			loader->state = loader->resume;
+			memcpy (loader->hdr, loader->saved, loader->saved_len);
+			loader->hdr_len = loader->saved_len;
+			loader->saved_len = 0;
+		}
+		else
+			loader->state = IL_BIM_HEADER;
+		break;
+
+	case IL_PS3_NEXT:
+		if (hdr[0] == JPEG_MARKER && hdr[1] == JPEG_MARKER_APP13) {
+			loader->marker = hdr[1];
+			loader->state = IL_LENGTH;
+			break;
+		}
+		/* Not a continuation, so handle it as any other marker */
+		if (iptc_loader_end_ps3 (loader) < 0)
+			break;
+		loader->state = IL_MARKER;
+		iptc_loader_process (loader);
+		break;
+
+	case IL_BIM_HEADER:
+		if (memcmp (hdr, JPEG_BIM_ID, 4)) {
+			loader->status = IPTC_LOADER_ERROR;
+			break;
+		}
+		loader->bim_type = iptc_get_short (hdr + 4,
+				IPTC_BYTE_ORDER_MOTOROLA);
+		/* The name is a padded pascal string, whose length byte
+		 * was the last byte of the header */
+		s = hdr[6] + 1;
+		s += (s & 1);
+		iptc_loader_skip (loader, s - 1, IL_BIM_SIZE);
+		break;
+
+	case IL_BIM_SIZE:
+		len = iptc_get_long (hdr, IPTC_BYTE_ORDER_MOTOROLA);
+		if (loader->bim_type == JPEG_BIM_IPTC_TYPE) {
+			if (len > IPTC_LOADER_MAX_SIZE) {
+				loader->status = IPTC_LOADER_ERROR;
+				break;
+			}
+			loader->iptc_size = len;
+			loader->iptc_len = 0;
+			if (!len) {
+				loader->status = IPTC_LOADER_DONE;
+				break;
+			}
+			loader->state = IL_IPTC_DATA;
+			break;
+		}
+		iptc_loader_skip (loader, len,
+				(len & 1) ? IL_BIM_PAD : IL_BIM_HEADER);
+		break;
+
+	case IL_BIM_PAD:
+		loader->state = IL_BIM_HEADER;
+		break;
+
+	default:
+		break;
+	}
+}
+
+/* Makes room for @n more bytes of IPTC data, which are all in the
+ * current segment.  Grows to the end of the segment at least, so that
+ * there is a single allocation unless the data is split. */
+static int
+iptc_loader_grow (IptcLoader *loader, unsigned int n)
+{
+	unsigned int size;
+	unsigned char *iptc;
+
+	if (loader->iptc_len + n <= loader->iptc_alloc)
+		return 0;
+
+	size = loader->iptc_len + loader->seg_left;
+	if (size < 2 * loader->iptc_alloc)
+		size = 2 * loader->iptc_alloc;
+	if (size > loader->iptc_size)
+		size = loader->iptc_size;
+	iptc = iptc_mem_realloc (loader->mem, loader->iptc, size);
+	if (!iptc)
+		return -1;
+	loader->iptc = iptc;
+	loader->iptc_alloc = size;
+	return 0;
+}
+
+/**
+ * iptc_loader_write:
+ * @loader: the loader
+ * @buf: the next piece of the JPEG file
+ * @size: size in bytes of @buf
+ *
+ * Feeds the next @size bytes of a JPEG file to @loader.  The file may
+ * be split into pieces of any size, including a single byte at a time,
+ * and the pieces must be written in order starting from the beginning
+ * of the file.  The loader keeps only the state needed to resume the
+ * scan and the IPTC data itself, so @buf may be reused as soon as this
+ * function returns.
+ *
+ * The headers of the file are scanned for a "Photoshop 3.0" APP13
+ * segment containing an IPTC resource.  A Photoshop header too large
+ * for one segment, split across several consecutive ones as
+ * iptc_jpeg_read_ps3() expects, is followed into the next segment,
+ * including in the middle of a resource.  Once the complete IPTC block
+ * has been received, or it is clear that the file contains none, no
+ * more input is needed and the rest of the file does not need to be
+ * read at all.  Writing more data to a loader that has finished has
+ * no effect.
+ *
+ * Memory for the IPTC data is allocated as the segments holding it
+ * are received, rather than trusting the size in the resource header,
+ * and IPTC resources larger than 16 MB are rejected.
+ *
+ * Returns: #IPTC_LOADER_NEED_MORE if more input is required,
+ * #IPTC_LOADER_DONE once the IPTC data is available through
+ * iptc_loader_get_data(), #IPTC_LOADER_NOT_FOUND if the image data
+ * was reached without finding any IPTC data, or #IPTC_LOADER_ERROR if
+ * the input is not a valid JPEG file or memory could not be allocated.
+ */
+IptcLoaderStatus
+iptc_loader_write (IptcLoader *loader, const unsigned char *buf,
+		unsigned int size)
+{
+	unsigned int n, want, avail;
+	int in_ps3;
+
+	if (!loader) return IPTC_LOADER_ERROR;
+	if (!buf) return loader->status;
+
+	while (loader->status == IPTC_LOADER_NEED_MORE && size > 0) {
+		if (loader->in_ps3 && !loader->seg_left) {
+			/* End of the segment: check whether the next one
+			 * continues the Photoshop 3.0 header */
+			loader->in_ps3 = 0;
+			loader->cont = 1;
+			loader->resume = loader->state;
+			memcpy (loader->saved, loader->hdr, loader->hdr_len);
+			loader->saved_len = loader->hdr_len;
+			loader->hdr_len = 0;
+			loader->state = IL_PS3_NEXT;
+		}
+
+		/* Resources never go past the end of the segment data */
+		in_ps3 = loader->in_ps3;
+		avail = in_ps3 ? MIN (size, loader->seg_left) : size;
+
+		switch (loader->state) {
+		case IL_SKIP:
+			n = MIN (avail, loader->skip);
+			loader->skip -= n;
+			if (!loader->skip)
+				loader->state = loader->next_state;
+			break;
+
+		case IL_IPTC_DATA:
+			n = MIN (avail, loader->iptc_size - loader->iptc_len);
+			if (iptc_loader_grow (loader, n) < 0) {
+				loader->status = IPTC_LOADER_ERROR;
+				n = 0;
+				break;
+			}
+			memcpy (loader->iptc + loader->iptc_len, buf, n);
+			loader->iptc_len += n;
+			if (loader->iptc_len == loader->iptc_size)
+				loader->status = IPTC_LOADER_DONE;
+			break;
+
+		default:
+			want = iptc_loader_header_size (loader->state);
+			n = MIN (avail, want - loader->hdr_len);
+			memcpy (loader->hdr + loader->hdr_len, buf, n);
+			loader->hdr_len += n;
+			if (loader->hdr_len == want) {
+				loader->hdr_len = 0;
+				iptc_loader_process (loader);
+			}
+			break;
+		}
+		buf += n;
+		size -= n;
+		if (in_ps3)
+			loader->seg_left -= n;
+	}
+
+	return loader->status;
+}
+
+/**
+ * iptc_loader_get_status:
+ * @loader: the loader
+ *
+ * Returns: the same value as the last call to iptc_loader_write(), or
+ * #IPTC_LOADER_NEED_MORE if nothing has been written yet.
+ */
+IptcLoaderStatus
+iptc_loader_get_status (IptcLoader *loader)
+{
+	if (!loader) return IPTC_LOADER_ERROR;
+	return loader->status;
+}
+
+/**
+ * iptc_loader_get_needed:
+ * @loader: the loader
+ *
+ * Reports how many more bytes @loader needs before it can make any
+ * progress.  This is a lower bound rather than the total: while a
+ * segment that does not interest the loader is being passed over,
+ * it is the number of bytes remaining in that segment; while the IPTC
+ * resource is being received, it is the number of bytes of IPTC data
+ * still missing.  It can be used to size the next read, for example
+ * the length of the next range request.
+ *
+ * Returns: the number of bytes needed, or 0 if @loader has finished.
+ */
+unsigned int
+iptc_loader_get_needed (IptcLoader *loader)
+{
+	if (!loader || loader->status != IPTC_LOADER_NEED_MORE)
+		return 0;
+
+	switch (loader->state) {
+	case IL_SKIP:
+		return loader->skip;
+	case IL_IPTC_DATA:
+		return loader->iptc_size - loader->iptc_len;
+	default:
+		return iptc_loader_header_size (loader->state) -
+			loader->hdr_len;
+	}
+}
+
+/**
+ * iptc_loader_get_buf:
+ * @loader: the loader
+ * @size: output parameter, the size in bytes of the IPTC data
+ *
+ * Gives access to the raw IPTC bytestream found by @loader, which
+ * remains owned by the loader and is valid until it is reset or
+ * freed.  It can be decoded with iptc_data_load() or
+ * iptc_parse_stream().
+ *
+ * Returns: a pointer to the IPTC data, or NULL if @loader has not
+ * reached #IPTC_LOADER_DONE or the IPTC resource is empty.
+ */
+const unsigned char *
+iptc_loader_get_buf (IptcLoader *loader, unsigned int *size)
+{
+	if (!loader || loader->status != IPTC_LOADER_DONE) {
+		if (size)
+			*size = 0;
+		return NULL;
+	}
+
+	if (size)
+		*size = loader->iptc_size;
+	return loader->iptc;
+}
+
+/**
+ * iptc_loader_get_data:
+ * @loader: the loader
+ *
+ * Allocates a new collection of datasets initialized by decoding the
+ * IPTC data found by @loader.  The new object does not depend on
+ * @loader, which may be reset or freed afterwards.  This allocation will
+ * set the #IptcData refcount to 1, so use iptc_data_unref() when
+ * finished with the object.
+ *
+ * Returns: pointer to the new #IptcData object.  NULL on error, or if
+ * @loader has not reached #IPTC_LOADER_DONE.
+ */
+IptcData *
+iptc_loader_get_data (IptcLoader *loader)
+{
+	IptcData *data;
+
+	if (!loader || loader->status != IPTC_LOADER_DONE)
+		return NULL;
+
+	data = iptc_data_new_mem (loader->mem);
+	if (!data)
+		return NULL;
+	if (loader->iptc_size && iptc_data_load (data, loader->iptc,
+				loader->iptc_size) < 0) {
+		iptc_data_unref (data);
+		return NULL;
+	}
+
+	return data;
+}
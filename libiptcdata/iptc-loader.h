@@ -0,0 +1,58 @@
+/* iptc-loader.h
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __IPTC_LOADER_H__
+#define __IPTC_LOADER_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include <libiptcdata/iptc-data.h>
+#include <libiptcdata/iptc-mem.h>
+
+typedef struct _IptcLoader IptcLoader;
+
+typedef enum {
+	IPTC_LOADER_NEED_MORE,
+	IPTC_LOADER_DONE,
+	IPTC_LOADER_NOT_FOUND,
+	IPTC_LOADER_ERROR
+} IptcLoaderStatus;
+
+IptcLoader *iptc_loader_new     (void);
+IptcLoader *iptc_loader_new_mem (IptcMem *mem);
+void        iptc_loader_ref     (IptcLoader *loader);
+void        iptc_loader_unref   (IptcLoader *loader);
+void        iptc_loader_free    (IptcLoader *loader);
+
+void        iptc_loader_reset   (IptcLoader *loader);
+IptcLoaderStatus iptc_loader_write (IptcLoader *loader,
+		const unsigned char *buf, unsigned int size);
+IptcLoaderStatus iptc_loader_get_status (IptcLoader *loader);
+unsigned int iptc_loader_get_needed (IptcLoader *loader);
+
+const unsigned char *iptc_loader_get_buf (IptcLoader *loader,
+		unsigned int *size);
+IptcData   *iptc_loader_get_data (IptcLoader *loader);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* __IPTC_LOADER_H__ */
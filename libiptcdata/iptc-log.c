@@ -20,15 +20,17 @@
 
 #include <config.h>
 #include <libiptcdata/iptc-log.h>
+#include "iptc-atomic.h"
 #include "i18n.h"
 
 #include <string.h>
 
 struct _IptcLog {
-	unsigned int ref_count;
+	IptcAtomic ref_count;
 
 	IptcLogFunc func;
 	void *data;
+	IptcLogLevel level;
 
 	IptcMem *mem;
 };
@@ -72,7 +74,7 @@ iptc_log_new_mem (IptcMem *mem)
 
 	log = iptc_mem_alloc (mem, sizeof (IptcLog));
 	if (!log) return NULL;
-	log->ref_count = 1;
+	iptc_atomic_init (&log->ref_count, 1);
 
 	log->mem = mem;
 	iptc_mem_ref (mem);
@@ -95,15 +97,14 @@ void
 iptc_log_ref (IptcLog *log)
 {
 	if (!log) return;
-	log->ref_count++;
+	iptc_atomic_inc (&log->ref_count);
 }
 
 void
 iptc_log_unref (IptcLog *log)
 {
 	if (!log) return;
-	if (log->ref_count > 0) log->ref_count--;
-	if (!log->ref_count) iptc_log_free (log);
+	if (!iptc_atomic_dec (&log->ref_count)) iptc_log_free (log);
 }
 
 void
@@ -122,6 +123,49 @@ iptc_log_set_func (IptcLog *log, IptcLogFunc func, void *data)
 	log->data = data;
 }
 
+/**
+ * iptc_log_set_level:
+ * @log: the log object
+ * @level: the least important kind of message that should be delivered
+ *
+ * Filters the messages passed to the logging function.  With
+ * %IPTC_LOG_LEVEL_DEBUG, the default, every message is delivered.
+ * %IPTC_LOG_LEVEL_ERROR drops debugging information and
+ * %IPTC_LOG_LEVEL_NONE drops everything.  The library checks the level
+ * before formatting a message, so filtered messages cost nothing.
+ */
+void
+iptc_log_set_level (IptcLog *log, IptcLogLevel level)
+{
+	if (!log) return;
+	log->level = level;
+}
+
+/**
+ * iptc_log_enabled:
+ * @log: the log object, may be NULL
+ * @code: the kind of message about to be logged
+ *
+ * Tells whether a message of kind @code would reach a logging function,
+ * so that callers can skip building expensive arguments otherwise.
+ *
+ * Returns: 1 if the message would be delivered, 0 if not
+ */
+int
+iptc_log_enabled (IptcLog *log, IptcLogCode code)
+{
+	if (!log || !log->func)
+		return 0;
+	switch (log->level) {
+	case IPTC_LOG_LEVEL_DEBUG:
+		return 1;
+	case IPTC_LOG_LEVEL_ERROR:
+		return code != IPTC_LOG_CODE_DEBUG;
+	default:
+		return 0;
+	}
+}
+
 void
 iptc_log (IptcLog *log, IptcLogCode code, const char *domain,
 	  const char *format, ...)
@@ -137,7 +181,6 @@ void
 iptc_logv (IptcLog *log, IptcLogCode code, const char *domain,
 	   const char *format, va_list args)
 {
-	if (!log) return;
-	if (!log->func) return;
+	if (!iptc_log_enabled (log, code)) return;
 	log->func (log, code, domain, format, args, log->data);
 }
@@ -50,6 +50,15 @@ typedef void (* IptcLogFunc) (IptcLog *log, IptcLogCode, const char *domain,
 
 void     iptc_log_set_func (IptcLog *log, IptcLogFunc func, void *data);
 
+typedef enum {
+	IPTC_LOG_LEVEL_DEBUG,
+	IPTC_LOG_LEVEL_ERROR,
+	IPTC_LOG_LEVEL_NONE
+} IptcLogLevel;
+
+void     iptc_log_set_level (IptcLog *log, IptcLogLevel level);
+int      iptc_log_enabled   (IptcLog *log, IptcLogCode code);
+
 void     iptc_log  (IptcLog *log, IptcLogCode, const char *domain,
 		    const char *format, ...)
 #ifdef __GNUC__
@@ -1,12 +1,38 @@
+#include <config.h>
 #include <libiptcdata/iptc-mem.h>
+#include "iptc-atomic.h"
+
 #include <stdlib.h>
+#include <string.h>
+
+/* Every arena block is preceded by a header holding its size, so that
+ * iptc_mem_realloc() knows how much to copy.  The header is padded so
+ * that the returned pointers stay suitably aligned for any type. */
+#define ARENA_ALIGN		16
+#define ARENA_ROUND(n)		(((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+#define ARENA_HEADER		ARENA_ROUND (sizeof (size_t))
+#define ARENA_MIN_CHUNK		4096
+
+typedef struct _IptcMemChunk IptcMemChunk;
 
+struct _IptcMemChunk {
+	IptcMemChunk *next;
+	size_t size;
+	size_t used;
+	size_t last;
+};
+
+#define CHUNK_DATA(c)		((unsigned char *)(c) + ARENA_ROUND (sizeof (IptcMemChunk)))
 
 struct _IptcMem {
-	unsigned int ref_count;
+	IptcAtomic ref_count;
 	IptcMemAllocFunc alloc_func;
 	IptcMemReallocFunc realloc_func;
 	IptcMemFreeFunc free_func;
+
+	/* Only used by arenas created with iptc_mem_new_arena() */
+	IptcMemChunk *chunks;
+	IptcMemChunk *current;
 };
 
 static void *
@@ -37,11 +63,13 @@ iptc_mem_new (IptcMemAllocFunc alloc_func, IptcMemReallocFunc realloc_func,
 	mem = alloc_func ? alloc_func (sizeof (IptcMem)) :
 		           realloc_func (NULL, sizeof (IptcMem));
 	if (!mem) return NULL;
-	mem->ref_count = 1;
+	iptc_atomic_init (&mem->ref_count, 1);
 
 	mem->alloc_func   = alloc_func;
 	mem->realloc_func = realloc_func;
 	mem->free_func    = free_func;
+	mem->chunks = NULL;
+	mem->current = NULL;
 
 	return mem;
 }
@@ -50,21 +78,121 @@ void
 iptc_mem_ref (IptcMem *mem)
 {
 	if (!mem) return;
-	mem->ref_count++;
+	iptc_atomic_inc (&mem->ref_count);
 }
 
 void
 iptc_mem_unref (IptcMem *mem)
 {
 	if (!mem) return;
-	if (!--mem->ref_count)
-		iptc_mem_free (mem, mem);
+	if (iptc_atomic_dec (&mem->ref_count))
+		return;
+
+	if (mem->chunks) {
+		IptcMemChunk *c, *next;
+		for (c = mem->chunks; c; c = next) {
+			next = c->next;
+			free (c);
+		}
+		free (mem);
+		return;
+	}
+	iptc_mem_free (mem, mem);
+}
+
+static IptcMemChunk *
+iptc_mem_chunk_new (size_t size)
+{
+	IptcMemChunk *c;
+
+	c = malloc (ARENA_ROUND (sizeof (IptcMemChunk)) + size);
+	if (!c) return NULL;
+	c->next = NULL;
+	c->size = size;
+	c->used = 0;
+	c->last = 0;
+	return c;
+}
+
+static void *
+iptc_mem_arena_alloc (IptcMem *mem, IptcLong ds)
+{
+	IptcMemChunk *c = mem->current;
+	size_t need = ARENA_HEADER + ARENA_ROUND ((size_t) ds);
+	unsigned char *p;
+
+	/* Move on to the next chunk (kept from before the last reset)
+	 * or add a new one, at least twice the size of the current. */
+	while (c->size - c->used < need) {
+		if (!c->next || c->next->size < need) {
+			IptcMemChunk *n;
+			size_t size = 2 * c->size;
+
+			if (size < need)
+				size = need;
+			n = iptc_mem_chunk_new (size);
+			if (!n) return NULL;
+			n->next = c->next;
+			c->next = n;
+		}
+		c = c->next;
+		c->used = 0;
+		c->last = 0;
+		mem->current = c;
+	}
+
+	p = CHUNK_DATA (c) + c->used;
+	*(size_t *) p = (size_t) ds;
+	c->last = c->used;
+	c->used += need;
+	p += ARENA_HEADER;
+	memset (p, 0, (size_t) ds);
+	return p;
+}
+
+static void *
+iptc_mem_arena_realloc (IptcMem *mem, void *d, IptcLong ds)
+{
+	IptcMemChunk *c = mem->current;
+	unsigned char *p = d;
+	size_t old;
+	void *n;
+
+	if (!d)
+		return iptc_mem_arena_alloc (mem, ds);
+
+	old = *(size_t *) (p - ARENA_HEADER);
+
+	/* The most recent block of the current chunk can simply grow
+	 * or shrink where it is. */
+	if (p - ARENA_HEADER == CHUNK_DATA (c) + c->last) {
+		size_t need = ARENA_HEADER + ARENA_ROUND ((size_t) ds);
+		if (c->size - c->last >= need) {
+			if ((size_t) ds > old)
+				memset (p + old, 0, (size_t) ds - old);
+			*(size_t *) (p - ARENA_HEADER) = (size_t) ds;
+			c->used = c->last + need;
+			return d;
+		}
+	}
+
+	if ((size_t) ds <= old) {
+		*(size_t *) (p - ARENA_HEADER) = (size_t) ds;
+		return d;
+	}
+
+	n = iptc_mem_arena_alloc (mem, ds);
+	if (!n) return NULL;
+	memcpy (n, d, old);
+	return n;
 }
 
 void
 iptc_mem_free (IptcMem *mem, void *d)
 {
 	if (!mem) return;
+	/* Arena blocks are only released by iptc_mem_reset() */
+	if (mem->chunks) return;
 	if (mem->free_func) {
 		mem->free_func (d);
 		return;
@@ -75,6 +203,8 @@ void *
 iptc_mem_alloc (IptcMem *mem, IptcLong ds)
 {
 	if (!mem) return NULL;
+	if (mem->chunks)
+		return iptc_mem_arena_alloc (mem, ds);
 	if (mem->alloc_func || mem->realloc_func)
 		return mem->alloc_func ? mem->alloc_func (ds) :
 					 mem->realloc_func (NULL, ds);
@@ -84,6 +214,8 @@ iptc_mem_alloc (IptcMem *mem, IptcLong ds)
 void *
 iptc_mem_realloc (IptcMem *mem, void *d, IptcLong ds)
 {
+	if (mem && mem->chunks)
+		return iptc_mem_arena_realloc (mem, d, ds);
 	return (mem && mem->realloc_func) ? mem->realloc_func (d, ds) : NULL;
 }
 
@@ -93,3 +225,67 @@ iptc_mem_new_default (void)
 	return iptc_mem_new (iptc_mem_alloc_func, iptc_mem_realloc_func,
 			     iptc_mem_free_func);
 }
+
+/**
+ * iptc_mem_new_arena:
+ * @size_hint: expected number of bytes needed between two calls to
+ * iptc_mem_reset(), or 0 for a small default
+ *
+ * Creates a memory manager that hands out memory from large chunks
+ * obtained with malloc() instead of allocating every object separately.
+ * Freeing memory through this manager does nothing; all of it is
+ * reclaimed at once by iptc_mem_reset(), which keeps the chunks so that
+ * later allocations can reuse them.  A worker that processes one file
+ * at a time can therefore create one arena, pass it to
+ * iptc_data_new_mem(), release the #IptcData when done and reset the
+ * arena before moving on to the next file, without calling malloc()
+ * once the arena has grown to its working size.  An arena must not be
+ * used from several threads at the same time.
+ *
+ * Returns: a new #IptcMem with a refcount of 1, NULL on error
+ */
+IptcMem *
+iptc_mem_new_arena (IptcLong size_hint)
+{
+	IptcMem *mem;
+	size_t size = size_hint;
+
+	if (size < ARENA_MIN_CHUNK)
+		size = ARENA_MIN_CHUNK;
+
+	mem = calloc (1, sizeof (IptcMem));
+	if (!mem) return NULL;
+	mem->chunks = iptc_mem_chunk_new (size);
+	if (!mem->chunks) {
+		free (mem);
+		return NULL;
+	}
+	mem->current = mem->chunks;
+	iptc_atomic_init (&mem->ref_count, 1);
+
+	return mem;
+}
+
+/**
+ * iptc_mem_reset:
+ * @mem: an arena created with iptc_mem_new_arena()
+ *
+ * Makes all memory handed out by an arena available again, in constant
+ * time.  This is only allowed once every object created with @mem has
+ * been released, which is checked through the refcount of @mem: the
+ * caller must hold the only remaining reference.
+ *
+ * Returns: 0 on success, -1 if @mem is not an arena or is still
+ * referenced by other objects
+ */
+int
+iptc_mem_reset (IptcMem *mem)
+{
+	if (!mem || !mem->chunks || iptc_atomic_get (&mem->ref_count) != 1)
+		return -1;
+
+	mem->current = mem->chunks;
+	mem->current->used = 0;
+	mem->current->last = 0;
+	return 0;
+}
@@ -47,6 +47,10 @@ void  iptc_mem_free    (IptcMem *, void *);
 /* For your convenience */
 IptcMem *iptc_mem_new_default (void);
 
+/* Bump allocator, freed in bulk */
+IptcMem *iptc_mem_new_arena (IptcLong size_hint);
+int      iptc_mem_reset     (IptcMem *);
+
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
@@ -0,0 +1,88 @@
+/* iptc-private.h
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __IPTC_PRIVATE_H__
+#define __IPTC_PRIVATE_H__
+
+/* Used internally within libiptcdata.  Nothing declared here is
+ * installed or part of the public API. */
+
+#include "iptc-data.h"
+#include "iptc-dataset.h"
+#include "iptc-atomic.h"
+
+/* Set when the payload points into a buffer owned by someone else */
+#define IPTC_DATASET_BORROWED	(1 << 0)
+/* Set on the datasets of a collection made by iptc_data_freeze(),
+ * which share its allocation and are never modified */
+#define IPTC_DATASET_FROZEN	(1 << 1)
+/* Set on a dataset added through an #IptcDataEdit that has not been
+ * committed yet */
+#define IPTC_DATASET_PENDING	(1 << 2)
+
+/* Buffer that datasets borrow their payload from.  Each of them, and
+ * anything else pointing into the buffer, holds a reference, and the
+ * destroy function is called when the last one is released. */
+typedef struct {
+	IptcAtomic ref_count;
+	IptcMem *mem;
+	IptcDestroyFunc destroy;
+	void *user_data;
+} IptcBorrow;
+
+struct _IptcDataSetPrivate
+{
+	IptcAtomic ref_count;
+	unsigned int flags;
+
+	IptcMem *mem;
+
+	/* Reference on the buffer a borrowed payload points into, NULL
+	 * if the application keeps it alive itself */
+	IptcBorrow *borrow;
+
+	/* Next dataset with the same record and tag in the parent
+	 * collection, and on the first such dataset, the last one.
+	 * Maintained by iptc-data.c. */
+	IptcDataSet *next;
+	IptcDataSet *last;
+
+	/* While an #IptcDataEdit is open on the parent collection, the
+	 * position of the dataset in it, or for a pending dataset, its
+	 * entry in the edit.  For a dataset created from a lazily loaded
+	 * header, the number of the header.  Maintained by iptc-data.c. */
+	unsigned int pos;
+};
+
+/* iptc-data.c */
+void iptc_data_dataset_retagged (IptcData *data, IptcDataSet *ds);
+
+/* iptc-tag.c */
+const IptcTagInfo *iptc_tag_get_table (void);
+
+/* iptc-dataset.c */
+IptcBorrow *iptc_borrow_new (IptcMem *mem, IptcDestroyFunc destroy,
+		void *user_data);
+void iptc_borrow_ref (IptcBorrow *borrow);
+void iptc_borrow_unref (IptcBorrow *borrow);
+int  iptc_dataset_set_data_borrowed (IptcDataSet *dataset,
+		const unsigned char *buf, unsigned int size,
+		IptcBorrow *borrow);
+IptcDataSet *iptc_dataset_share (IptcDataSet *dataset);
+
+#endif /* __IPTC_PRIVATE_H__ */
@@ -20,6 +20,7 @@
 
 #include "config.h"
 #include "iptc-tag.h"
+#include "iptc-private.h"
 #include "i18n.h"
 
 #include <string.h>
@@ -414,6 +415,112 @@ static IptcTagInfo IptcTagTable[] = {
 	{ 0, 0, NULL, NULL, NULL }
 };
 
+/* The whole table, for iptc_data_validate(), terminated by an entry
+ * with a record of 0 */
+const IptcTagInfo *
+iptc_tag_get_table (void)
+{
+	return IptcTagTable;
+}
+
+/* Lookup tables derived from IptcTagTable on first use.  Both hold
+ * the position + 1 of an entry in IptcTagTable, 0 meaning none. */
+static unsigned char IptcTagIndex[9][256];
+
+/* Open addressing hash of the tag names, keyed on the lowercase name
+ * so that the same table serves exact and case-insensitive lookups */
+#define NAME_HASH_SIZE	256
+static unsigned char IptcTagNameHash[NAME_HASH_SIZE];
+
+/* 0 until the tables are built, 1 while one thread builds them, and
+ * 2 once they can be used */
+static IptcAtomic IptcTagTablesState;
+
+#define ASCII_TOLOWER(c)	((c) >= 'A' && (c) <= 'Z' ? (c) - 'A' + 'a' : (c))
+
+static unsigned int
+iptc_tag_name_hash (const char *name)
+{
+	unsigned int h = 2166136261u;
+
+	for (; *name; name++)
+		h = (h ^ (unsigned char) ASCII_TOLOWER (*name)) * 16777619u;
+	return h;
+}
+
+static int
+iptc_tag_name_equal_nocase (const char *a, const char *b)
+{
+	for (; *a && *b; a++, b++)
+		if (ASCII_TOLOWER (*a) != ASCII_TOLOWER (*b))
+			return 0;
+	return *a == *b;
+}
+
+static void
+iptc_tag_build_tables (void)
+{
+	unsigned int i, h;
+
+	for (i = 0; IptcTagTable[i].record; i++) {
+		IptcTagIndex[IptcTagTable[i].record - 1]
+			[IptcTagTable[i].tag] = i + 1;
+
+		h = iptc_tag_name_hash (IptcTagTable[i].name);
+		while (IptcTagNameHash[h % NAME_HASH_SIZE])
+			h++;
+		IptcTagNameHash[h % NAME_HASH_SIZE] = i + 1;
+	}
+}
+
+static void
+iptc_tag_init_tables (void)
+{
+	if (iptc_atomic_get (&IptcTagTablesState) == 2)
+		return;
+
+	if (iptc_atomic_cas (&IptcTagTablesState, 0, 1)) {
+		iptc_tag_build_tables ();
+		iptc_atomic_set (&IptcTagTablesState, 2);
+		return;
+	}
+
+	/* Another thread is building the tables, which takes very little
+	 * time */
+	while (iptc_atomic_get (&IptcTagTablesState) != 2)
+		;
+}
+
+static const IptcTagInfo *
+iptc_tag_lookup (IptcRecord record, IptcTag tag)
+{
+	unsigned int i;
+
+	iptc_tag_init_tables ();
+
+	if (record < 1 || record > 9 || (unsigned int) tag > 255)
+		return NULL;
+	i = IptcTagIndex[record - 1][tag];
+	return i ? IptcTagTable + i - 1 : NULL;
+}
+
+static const IptcTagInfo *
+iptc_tag_lookup_name (const char *name, int nocase)
+{
+	unsigned int h, i;
+
+	iptc_tag_init_tables ();
+
+	for (h = iptc_tag_name_hash (name);
+			(i = IptcTagNameHash[h % NAME_HASH_SIZE]); h++) {
+		const char *n = IptcTagTable[i - 1].name;
+		if (nocase ? iptc_tag_name_equal_nocase (n, name) :
+				!strcmp (n, name))
+			return IptcTagTable + i - 1;
+	}
+	return NULL;
+}
+
 
 /**
  * iptc_tag_get_name:
@@ -430,14 +537,9 @@ static IptcTagInfo IptcTagTable[] = {
 const char *
 iptc_tag_get_name (IptcRecord record, IptcTag tag)
 {
-	unsigned int i;
+	const IptcTagInfo *info = iptc_tag_lookup (record, tag);
 
-	for (i = 0; IptcTagTable[i].record; i++)
-		if (IptcTagTable[i].record == record && 
-				IptcTagTable[i].tag == tag)
-			break;
-
-	return (IptcTagTable[i].name);
+	return info ? info->name : NULL;
 }
 
 /**
@@ -458,20 +560,16 @@ iptc_tag_get_name (IptcRecord record, IptcTag tag)
 char *
 iptc_tag_get_title (IptcRecord record, IptcTag tag)
 {
-	unsigned int i;
+	const IptcTagInfo *info;
 
 	bind_textdomain_codeset (GETTEXT_PACKAGE, "UTF-8");
 	bindtextdomain (GETTEXT_PACKAGE, LIBIPTCDATA_LOCALEDIR);
 
-	for (i = 0; IptcTagTable[i].record; i++)
-		if (IptcTagTable[i].record == record && 
-				IptcTagTable[i].tag == tag)
-			break;
-
-	if (!IptcTagTable[i].title)
+	info = iptc_tag_lookup (record, tag);
+	if (!info || !info->title)
 		return "";
 	else
-		return (_(IptcTagTable[i].title));
+		return (_(info->title));
 }
 
 /**
@@ -490,20 +588,16 @@ iptc_tag_get_title (IptcRecord record, IptcTag tag)
 char *
 iptc_tag_get_description (IptcRecord record, IptcTag tag)
 {
-	unsigned int i;
+	const IptcTagInfo *info;
 
 	bind_textdomain_codeset (GETTEXT_PACKAGE, "UTF-8");
 	bindtextdomain (GETTEXT_PACKAGE, LIBIPTCDATA_LOCALEDIR);
 
-	for (i = 0; IptcTagTable[i].record; i++)
-		if (IptcTagTable[i].record == record && 
-				IptcTagTable[i].tag == tag)
-			break;
-
-	if (!IptcTagTable[i].description)
+	info = iptc_tag_lookup (record, tag);
+	if (!info || !info->description)
 		return "";
 	else
-		return (_(IptcTagTable[i].description));
+		return (_(info->description));
 }
 
 /**
@@ -521,17 +615,7 @@ iptc_tag_get_description (IptcRecord record, IptcTag tag)
 const IptcTagInfo *
 iptc_tag_get_info (IptcRecord record, IptcTag tag)
 {
-	unsigned int i;
-
-	for (i = 0; IptcTagTable[i].record; i++)
-		if (IptcTagTable[i].record == record && 
-				IptcTagTable[i].tag == tag)
-			break;
-
-	if (IptcTagTable[i].record)
-		return IptcTagTable+i;
-	else
-		return NULL;
+	return iptc_tag_lookup (record, tag);
 }
 
 /**
@@ -549,20 +633,216 @@ iptc_tag_get_info (IptcRecord record, IptcTag tag)
 int
 iptc_tag_find_by_name (const char * name, IptcRecord * record, IptcTag * tag)
 {
-	unsigned int i;
+	const IptcTagInfo *info;
 
 	if (!name || !record || !tag)
 		return -1;
 
-	for (i = 0; IptcTagTable[i].record; i++) {
-		if (!strcmp (IptcTagTable[i].name, name)) {
-			*record = IptcTagTable[i].record;
-			*tag = IptcTagTable[i].tag;
-			return 0;
-		}
-	}
+	info = iptc_tag_lookup_name (name, 0);
+	if (!info)
+		return -1;
+
+	*record = info->record;
+	*tag = info->tag;
+	return 0;
+}
+
+/**
+ * iptc_tag_find_by_name_nocase:
+ * @name: the name to search for
+ * @record: output variable to store the record number
+ * @tag: output variable to store the tag number
+ *
+ * Same as iptc_tag_find_by_name(), except that the case of ASCII letters
+ * is ignored, so that "caption" and "CAPTION" both return 2:120.
+ *
+ * Returns: 0 on success, -1 on failure or if the tag name was not found
+ */
+int
+iptc_tag_find_by_name_nocase (const char * name, IptcRecord * record,
+		IptcTag * tag)
+{
+	const IptcTagInfo *info;
+
+	if (!name || !record || !tag)
+		return -1;
+
+	info = iptc_tag_lookup_name (name, 1);
+	if (!info)
+		return -1;
+
+	*record = info->record;
+	*tag = info->tag;
+	return 0;
+}
+
+/**
+ * iptc_tag_find_by_id:
+ * @id: the tag identifier to parse
+ * @record: output variable to store the record number
+ * @tag: output variable to store the tag number
+ *
+ * Resolves a tag identifier as typed by a user, which is either a pair
+ * of decimal record and tag numbers such as "2:120", or a tag name
+ * matched without regard to case such as "Caption".  Numeric
+ * identifiers are accepted for any record from 1 to 9 and tag from 0
+ * to 255, whether or not the tag is defined by the specification.
+ *
+ * Returns: 0 on success, -1 on failure or if the tag was not found
+ */
+int
+iptc_tag_find_by_id (const char * id, IptcRecord * record, IptcTag * tag)
+{
+	unsigned int r = 0, t = 0;
+	const char *a = id;
+
+	if (!id || !record || !tag)
+		return -1;
+
+	if (*a < '0' || *a > '9')
+		return iptc_tag_find_by_name_nocase (id, record, tag);
+
+	for (; *a >= '0' && *a <= '9' && r < 10; a++)
+		r = r * 10 + (*a - '0');
+	if (*a++ != ':' || *a < '0' || *a > '9')
+		return -1;
+	for (; *a >= '0' && *a <= '9' && t < 256; a++)
+		t = t * 10 + (*a - '0');
+	if (*a != '\0' || r < 1 || r > 9 || t > 255)
+		return -1;
+
+	*record = r;
+	*tag = t;
+	return 0;
+}
+
+#define IPTC_FILTER_VALID(r,t)	((r) >= 1 && (r) <= 9 && (t) < 256)
+
+/**
+ * iptc_tag_filter_clear:
+ * @filter: the filter to initialize
+ *
+ * Removes every record:tag combination from @filter.  Together with
+ * iptc_tag_filter_add(), this is the usual way to build a filter that
+ * selects only a few tags.  An #IptcTagFilter is a plain structure that
+ * may be allocated on the stack, but it must be initialized with
+ * either this function or iptc_tag_filter_fill() before use.
+ */
+void
+iptc_tag_filter_clear (IptcTagFilter *filter)
+{
+	if (!filter) return;
+	memset (filter->bits, 0, sizeof (filter->bits));
+}
 
-	return -1;
+/**
+ * iptc_tag_filter_fill:
+ * @filter: the filter to initialize
+ *
+ * Adds every record:tag combination to @filter.  Together with
+ * iptc_tag_filter_remove(), this is the usual way to build a filter that
+ * excludes only a few tags, such as %IPTC_TAG_PREVIEW_DATA.
+ */
+void
+iptc_tag_filter_fill (IptcTagFilter *filter)
+{
+	if (!filter) return;
+	memset (filter->bits, 0xff, sizeof (filter->bits));
+}
+
+/**
+ * iptc_tag_filter_add:
+ * @filter: the filter to modify
+ * @record: the record number of the tag
+ * @tag: the tag number
+ *
+ * Adds a single record:tag combination to @filter.
+ *
+ * Returns: 0 on success, -1 if @record is not between 1 and 9.
+ */
+int
+iptc_tag_filter_add (IptcTagFilter *filter, IptcRecord record, IptcTag tag)
+{
+	if (!filter || !IPTC_FILTER_VALID (record, tag))
+		return -1;
+	filter->bits[record - 1][tag >> 3] |= 1 << (tag & 7);
+	return 0;
+}
+
+/**
+ * iptc_tag_filter_remove:
+ * @filter: the filter to modify
+ * @record: the record number of the tag
+ * @tag: the tag number
+ *
+ * Removes a single record:tag combination from @filter.
+ *
+ * Returns: 0 on success, -1 if @record is not between 1 and 9.
+ */
+int
+iptc_tag_filter_remove (IptcTagFilter *filter, IptcRecord record, IptcTag tag)
+{
+	if (!filter || !IPTC_FILTER_VALID (record, tag))
+		return -1;
+	filter->bits[record - 1][tag >> 3] &= ~(1 << (tag & 7));
+	return 0;
+}
+
+/**
+ * iptc_tag_filter_add_record:
+ * @filter: the filter to modify
+ * @record: the record number
+ *
+ * Adds every tag of @record to @filter.
+ *
+ * Returns: 0 on success, -1 if @record is not between 1 and 9.
+ */
+int
+iptc_tag_filter_add_record (IptcTagFilter *filter, IptcRecord record)
+{
+	if (!filter || !IPTC_FILTER_VALID (record, 0))
+		return -1;
+	memset (filter->bits[record - 1], 0xff, sizeof (filter->bits[0]));
+	return 0;
+}
+
+/**
+ * iptc_tag_filter_remove_record:
+ * @filter: the filter to modify
+ * @record: the record number
+ *
+ * Removes every tag of @record from @filter.
+ *
+ * Returns: 0 on success, -1 if @record is not between 1 and 9.
+ */
+int
+iptc_tag_filter_remove_record (IptcTagFilter *filter, IptcRecord record)
+{
+	if (!filter || !IPTC_FILTER_VALID (record, 0))
+		return -1;
+	memset (filter->bits[record - 1], 0, sizeof (filter->bits[0]));
+	return 0;
+}
+
+/**
+ * iptc_tag_filter_contains:
+ * @filter: the filter to test
+ * @record: the record number of the tag
+ * @tag: the tag number
+ *
+ * Tests whether a record:tag combination is selected by @filter.
+ * Datasets with a record number outside the range 1 to 9 cannot be
+ * represented in a filter and are never selected.
+ *
+ * Returns: 1 if the combination is in @filter, 0 otherwise.
+ */
+int
+iptc_tag_filter_contains (const IptcTagFilter *filter, IptcRecord record,
+		IptcTag tag)
+{
+	if (!filter || !IPTC_FILTER_VALID (record, tag))
+		return 0;
+	return (filter->bits[record - 1][tag >> 3] >> (tag & 7)) & 1;
 }
 
 /**
@@ -163,6 +163,26 @@ const IptcTagInfo *iptc_tag_get_info     (IptcRecord record, IptcTag tag);
 char           *iptc_format_get_name	 (IptcFormat format);
 
 int iptc_tag_find_by_name (const char * name, IptcRecord * record, IptcTag * tag);
+int iptc_tag_find_by_name_nocase (const char * name, IptcRecord * record,
+		IptcTag * tag);
+int iptc_tag_find_by_id (const char * id, IptcRecord * record, IptcTag * tag);
+
+typedef struct _IptcTagFilter IptcTagFilter;
+
+struct _IptcTagFilter {
+	unsigned char	bits[9][32];	/* One bit per tag of records 1 to 9 */
+};
+
+void iptc_tag_filter_clear   (IptcTagFilter *filter);
+void iptc_tag_filter_fill    (IptcTagFilter *filter);
+int  iptc_tag_filter_add     (IptcTagFilter *filter, IptcRecord record,
+		IptcTag tag);
+int  iptc_tag_filter_remove  (IptcTagFilter *filter, IptcRecord record,
+		IptcTag tag);
+int  iptc_tag_filter_add_record    (IptcTagFilter *filter, IptcRecord record);
+int  iptc_tag_filter_remove_record (IptcTagFilter *filter, IptcRecord record);
+int  iptc_tag_filter_contains (const IptcTagFilter *filter, IptcRecord record,
+		IptcTag tag);
 
 #ifdef __cplusplus
 }
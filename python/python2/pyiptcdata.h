@@ -31,9 +31,6 @@
 #include <libiptcdata/iptc-data.h>
 #include <libiptcdata/iptc-jpeg.h>
 
-/* buffer length for IPTC_DATA */
-#define PS3_BUFLEN (256*256)
-
 /* typedef for a data object, which essentially holds a list of
    dataset object representing the actual IPTC data */
 typedef struct {
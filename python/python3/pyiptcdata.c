@@ -113,9 +113,8 @@ save(DataObject *self, PyObject *args, PyObject *keywds)
 	unsigned char *iptc_buf = NULL;
 	unsigned int iptc_len;
 
-	unsigned char old_ps3[PS3_BUFLEN];
-	unsigned char new_ps3[PS3_BUFLEN];
-	unsigned int old_ps3_len, new_ps3_len;
+	unsigned char *old_ps3, *new_ps3;
+	int old_ps3_len, new_ps3_len;
 
 	/* before we touch anything, make sure we have not been opened */
 	check_dataobject_open(self);
@@ -166,12 +165,25 @@ save(DataObject *self, PyObject *args, PyObject *keywds)
 	}
 
 	/* read in old PS3 data.  Other areas will therefore be
-	 * retained */
-	old_ps3_len = iptc_jpeg_read_ps3(infile, old_ps3, PS3_BUFLEN);
+	 * retained.  It may be split across several APP13 sections, so
+	 * size the buffer from the file. */
+	old_ps3_len = iptc_jpeg_get_ps3_size(infile);
 	if (old_ps3_len < 0) {
 		free(tmp_filename);
 		return NULL;
 	}
+	old_ps3 = malloc(old_ps3_len + 1);
+	if (old_ps3 == NULL) {
+		free(tmp_filename);
+		return PyErr_NoMemory();
+	}
+	rewind(infile);
+	old_ps3_len = iptc_jpeg_read_ps3(infile, old_ps3, old_ps3_len);
+	if (old_ps3_len < 0) {
+		free(old_ps3);
+		free(tmp_filename);
+		return NULL;
+	}
 
 
 	/* setup our iptc header */
@@ -184,24 +196,37 @@ save(DataObject *self, PyObject *args, PyObject *keywds)
 
 	/* save our IPTC data to a new stream */
 	if (iptc_data_save(self->d, &iptc_buf, &iptc_len) < 0) {
+		free(old_ps3);
 		free(tmp_filename);
 		return NULL;
 	}
 
-	/* now save that stream into a photoshop header */
+	/* now save that stream into a photoshop header, with room for
+	 * the old header, the new data and its resource header */
+	new_ps3_len = (old_ps3_len ? old_ps3_len : 14) + iptc_len + 13;
+	new_ps3 = malloc(new_ps3_len);
+	if (new_ps3 == NULL) {
+		iptc_data_free_buf(self->d, iptc_buf);
+		free(old_ps3);
+		free(tmp_filename);
+		return PyErr_NoMemory();
+	}
 	new_ps3_len = iptc_jpeg_ps3_save_iptc(old_ps3, old_ps3_len,
-					iptc_buf, iptc_len, new_ps3, PS3_BUFLEN);
+					iptc_buf, iptc_len, new_ps3, new_ps3_len);
 
 	/* free up the data stream */
 	iptc_data_free_buf(self->d, iptc_buf);
+	free(old_ps3);
 
 	/* now save this header into the actual jpeg. */
 	rewind(infile);
 	if (iptc_jpeg_save_with_ps3 (infile, outfile, new_ps3, new_ps3_len) < 0) {
+		free(new_ps3);
 		free(tmp_filename);
 		fprintf (stderr, "Failed to save image\n");
 		return NULL;
 	}
+	free(new_ps3);
 
 	fclose (infile);
 	fclose (outfile);
@@ -0,0 +1,56 @@
+/* bench-common.c
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "bench-common.h"
+
+#define KEYWORD_LEN	12
+
+double
+bench_seconds (void)
+{
+	return (double) clock () / CLOCKS_PER_SEC;
+}
+
+double
+bench_wall_seconds (void)
+{
+	struct timeval tv;
+
+	gettimeofday (&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+unsigned char *
+bench_keywords (unsigned int n, unsigned int *size)
+{
+	unsigned char *buf, *p;
+	char keyword[KEYWORD_LEN + 1];
+	unsigned int i;
+
+	*size = n * (5 + KEYWORD_LEN);
+	buf = malloc (*size);
+	if (!buf)
+		return NULL;
+
+	for (i = 0, p = buf; i < n; i++, p += 5 + KEYWORD_LEN) {
+		sprintf (keyword, "keyword%05u", i % 100000);
+		p[0] = 0x1c;
+		p[1] = 2;
+		p[2] = 25;
+		p[3] = 0;
+		p[4] = KEYWORD_LEN;
+		memcpy (p + 5, keyword, KEYWORD_LEN);
+	}
+	return buf;
+}
@@ -0,0 +1,27 @@
+/* bench-common.h
+ *
+ * Helpers shared by the benchmark programs.  They are built with the
+ * library but never run by "make check", since their output is
+ * timings rather than a pass or fail result.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ */
+
+#ifndef __BENCH_COMMON_H__
+#define __BENCH_COMMON_H__
+
+/* Processor time used so far, in seconds */
+double bench_seconds (void);
+
+/* Time elapsed since an arbitrary point, in seconds, for benchmarks
+ * that wait on I/O */
+double bench_wall_seconds (void);
+
+/* Builds an IPTC stream of @n Keywords datasets, to be released with
+ * free().  Returns NULL if memory runs out. */
+unsigned char *bench_keywords (unsigned int n, unsigned int *size);
+
+#endif /* __BENCH_COMMON_H__ */
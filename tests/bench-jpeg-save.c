@@ -0,0 +1,79 @@
+/* bench-jpeg-save.c
+ *
+ * Saves new IPTC data into a large JPEG file through
+ * iptc_jpeg_save_with_ps3(), which copies the image data through
+ * stdio, and through iptc_jpeg_save_with_ps3_fd(), which lets the
+ * kernel copy it where the system allows.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <libiptcdata/iptc-jpeg.h>
+
+#include "bench-common.h"
+#include "test-common.h"
+
+/* Size of the image data following the headers */
+#define IMAGE_SIZE	(32 * 1024 * 1024)
+#define ROUNDS		10
+
+/* Photoshop header holding a Caption */
+static const unsigned char ps3[] = {
+	'P', 'h', 'o', 't', 'o', 's', 'h', 'o', 'p', ' ', '3', '.', '0', 0,
+	'8', 'B', 'I', 'M', 0x04, 0x04, 0, 0, 0, 0, 0, 10,
+	0x1c, 2, 120, 0, 5, 'h', 'e', 'l', 'l', 'o',
+};
+
+static void
+report (const char *name, double elapsed)
+{
+	printf ("%-26s %10.3f %10.1f\n", name, elapsed / ROUNDS,
+			ROUNDS * (IMAGE_SIZE / 1048576.0) / elapsed);
+}
+
+int
+main (void)
+{
+	FILE *in = test_new_image (IMAGE_SIZE), *out = tmpfile ();
+	double start, elapsed;
+	unsigned int i;
+
+	if (!in || !out)
+		return 1;
+
+	printf ("%u MB image, %u saves each\n", IMAGE_SIZE / 1048576,
+			ROUNDS);
+	printf ("%-26s %10s %10s\n", "", "s/save", "MB/s");
+
+	start = bench_wall_seconds ();
+	for (i = 0; i < ROUNDS; i++) {
+		rewind (in);
+		rewind (out);
+		if (iptc_jpeg_save_with_ps3 (in, out, ps3, sizeof (ps3)) < 0 ||
+				fflush (out) != 0)
+			return 1;
+	}
+	elapsed = bench_wall_seconds () - start;
+	report ("iptc_jpeg_save_with_ps3", elapsed);
+
+	start = bench_wall_seconds ();
+	for (i = 0; i < ROUNDS; i++) {
+		if (lseek (fileno (in), 0, SEEK_SET) < 0 ||
+				lseek (fileno (out), 0, SEEK_SET) < 0)
+			return 1;
+		if (iptc_jpeg_save_with_ps3_fd (fileno (in), fileno (out),
+					ps3, sizeof (ps3)) < 0)
+			return 1;
+	}
+	elapsed = bench_wall_seconds () - start;
+	report ("iptc_jpeg_save_with_ps3_fd", elapsed);
+
+	fclose (in);
+	fclose (out);
+	return 0;
+}
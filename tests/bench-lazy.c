@@ -0,0 +1,91 @@
+/* bench-lazy.c
+ *
+ * Loads blocks of N Keywords lazily and eagerly, then walks the
+ * Keywords with iptc_data_get_next_dataset() and searches for a
+ * Caption that is not there.  A lazily loaded collection only creates
+ * the datasets that are returned, and searches it by reading the 2
+ * byte keys of its headers.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <libiptcdata/iptc-data.h>
+
+#include "bench-common.h"
+
+/* Datasets loaded for each N and mode, whatever the size of the block */
+#define TOTAL		(1 << 20)
+
+/* Loads @buf and either walks the Keywords or searches for a Caption */
+static int
+run (const unsigned char *buf, unsigned int size, int lazy, int walk)
+{
+	IptcData *data = iptc_data_new ();
+	IptcDataSet *ds, *next;
+	int n = 0;
+
+	if (!data)
+		return -1;
+	if ((lazy ? iptc_data_load_lazy (data, buf, size, NULL, NULL) :
+			iptc_data_load (data, buf, size)) < 0) {
+		iptc_data_unref (data);
+		return -1;
+	}
+
+	if (walk) {
+		for (ds = iptc_data_get_next_dataset (data, NULL, 2, 25); ds;
+				ds = next) {
+			next = iptc_data_get_next_dataset (data, ds, 2, 25);
+			iptc_dataset_unref (ds);
+			n++;
+		}
+	}
+	else if ((ds = iptc_data_get_dataset (data, 2, 120)) != NULL) {
+		iptc_dataset_unref (ds);
+		n = -1;
+	}
+
+	iptc_data_unref (data);
+	return n;
+}
+
+static double
+time_runs (const unsigned char *buf, unsigned int size, unsigned int n,
+		int lazy, int walk)
+{
+	unsigned int i, rounds = TOTAL / n;
+	double start = bench_seconds ();
+
+	for (i = 0; i < rounds; i++)
+		if (run (buf, size, lazy, walk) != (walk ? (int) n : 0))
+			return -1;
+	return (bench_seconds () - start) * 1e9 / ((double) rounds * n);
+}
+
+int
+main (void)
+{
+	unsigned char *buf;
+	unsigned int n, size;
+
+	printf ("ns per dataset to load and then walk or search\n");
+	printf ("%8s %12s %12s %12s %12s\n", "keywords",
+			"walk eager", "walk lazy", "miss eager", "miss lazy");
+	for (n = 1000; n <= 64000; n *= 4) {
+		buf = bench_keywords (n, &size);
+		if (!buf)
+			return 1;
+		printf ("%8u %12.1f %12.1f %12.1f %12.1f\n", n,
+				time_runs (buf, size, n, 0, 1),
+				time_runs (buf, size, n, 1, 1),
+				time_runs (buf, size, n, 0, 0),
+				time_runs (buf, size, n, 1, 0));
+		free (buf);
+	}
+	return 0;
+}
@@ -0,0 +1,52 @@
+/* bench-load.c
+ *
+ * Loads blocks of N Keywords for increasing N.  The time per dataset
+ * should stay flat, since the datasets array is sized once up front
+ * rather than reallocated for every dataset.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <libiptcdata/iptc-data.h>
+
+#include "bench-common.h"
+
+/* Datasets loaded for each N, whatever the size of the block */
+#define TOTAL		(1 << 21)
+
+int
+main (void)
+{
+	unsigned char *buf;
+	unsigned int n, size, i, rounds;
+	double start, elapsed;
+
+	printf ("%8s %10s %12s\n", "keywords", "seconds", "ns/dataset");
+	for (n = 1000; n <= 64000; n *= 2) {
+		buf = bench_keywords (n, &size);
+		if (!buf)
+			return 1;
+
+		rounds = TOTAL / n;
+		start = bench_seconds ();
+		for (i = 0; i < rounds; i++) {
+			IptcData *data = iptc_data_new ();
+
+			if (!data || iptc_data_load (data, buf, size) < 0 ||
+					data->count != n)
+				return 1;
+			iptc_data_unref (data);
+		}
+		elapsed = bench_seconds () - start;
+
+		printf ("%8u %10.3f %12.1f\n", n, elapsed,
+				elapsed * 1e9 / ((double) rounds * n));
+		free (buf);
+	}
+	return 0;
+}
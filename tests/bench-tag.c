@@ -0,0 +1,78 @@
+/* bench-tag.c
+ *
+ * Times iptc_tag_get_info() and iptc_tag_get_name() over every
+ * defined record:tag, against the linear scan of the tag table that
+ * they used to do.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <libiptcdata/iptc-tag.h>
+
+#include "bench-common.h"
+
+#define ROUNDS		20000
+
+/* Not part of the public API, but exported by the library */
+const IptcTagInfo *iptc_tag_get_table (void);
+
+static const IptcTagInfo *
+linear_get_info (const IptcTagInfo *table, IptcRecord record, IptcTag tag)
+{
+	unsigned int i;
+
+	for (i = 0; table[i].record; i++)
+		if (table[i].record == record && table[i].tag == tag)
+			return table + i;
+	return NULL;
+}
+
+int
+main (void)
+{
+	const IptcTagInfo *table = iptc_tag_get_table ();
+	unsigned int i, n, round;
+	unsigned long found = 0;
+	double start, linear, indexed;
+
+	for (n = 0; table[n].record; n++)
+		;
+
+	/* The first lookup builds the index */
+	iptc_tag_get_info (table[0].record, table[0].tag);
+
+	start = bench_seconds ();
+	for (round = 0; round < ROUNDS; round++)
+		for (i = 0; i < n; i++) {
+			found += linear_get_info (table, table[i].record,
+					table[i].tag) != NULL;
+			found += linear_get_info (table, table[i].record,
+					table[i].tag)->name != NULL;
+		}
+	linear = bench_seconds () - start;
+
+	start = bench_seconds ();
+	for (round = 0; round < ROUNDS; round++)
+		for (i = 0; i < n; i++) {
+			found += iptc_tag_get_info (table[i].record,
+					table[i].tag) != NULL;
+			found += iptc_tag_get_name (table[i].record,
+					table[i].tag) != NULL;
+		}
+	indexed = bench_seconds () - start;
+
+	if (found != 4UL * ROUNDS * n)
+		return 1;
+
+	printf ("%u tags, %u rounds of get_info and get_name\n", n, ROUNDS);
+	printf ("%-12s %10s %12s\n", "", "seconds", "ns/lookup");
+	printf ("%-12s %10.3f %12.1f\n", "linear scan", linear,
+			linear * 1e9 / (2.0 * ROUNDS * n));
+	printf ("%-12s %10.3f %12.1f\n", "index", indexed,
+			indexed * 1e9 / (2.0 * ROUNDS * n));
+	return 0;
+}
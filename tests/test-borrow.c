@@ -0,0 +1,115 @@
+/* test-borrow.c
+ *
+ * A buffer loaded without copying must stay alive for as long as any
+ * dataset borrows from it, even after the collection is released, and
+ * be handed back exactly once when nothing uses it anymore.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libiptcdata/iptc-data.h>
+
+#include "test-common.h"
+
+static const unsigned char stream[] = {
+	0x1c, 2, 25, 0, 2, 'k', '1',
+	0x1c, 2, 25, 0, 2, 'k', '2',
+	0x1c, 2, 120, 0, 5, 'h', 'e', 'l', 'l', 'o',
+};
+
+static int destroyed;
+
+static void
+destroy (void *user_data)
+{
+	destroyed++;
+	free (user_data);
+}
+
+static unsigned char *
+new_buf (void)
+{
+	unsigned char *buf = malloc (sizeof (stream));
+
+	if (buf)
+		memcpy (buf, stream, sizeof (stream));
+	destroyed = 0;
+	return buf;
+}
+
+int
+main (void)
+{
+	IptcData *d, *clone;
+	IptcDataSet *ds;
+	IptcTagFilter filter;
+	unsigned char *buf;
+
+	/* A dataset kept after its collection */
+	buf = new_buf ();
+	d = iptc_data_new ();
+	CHECK (iptc_data_load_borrowed (d, buf, sizeof (stream),
+				destroy, buf) == 0);
+	ds = iptc_data_get_dataset (d, 2, 120);
+	iptc_data_unref (d);
+	CHECK (destroyed == 0);
+	CHECK (ds && ds->size == 5 && !memcmp (ds->data, "hello", 5));
+	iptc_dataset_unref (ds);
+	CHECK (destroyed == 1);
+
+	/* A clone outliving the original */
+	buf = new_buf ();
+	d = iptc_data_new ();
+	CHECK (iptc_data_load_borrowed (d, buf, sizeof (stream),
+				destroy, buf) == 0);
+	clone = iptc_data_clone (d);
+	iptc_data_unref (d);
+	CHECK (destroyed == 0);
+	CHECK (clone && clone->count == 3 &&
+			!memcmp (clone->datasets[1]->data, "k2", 2));
+	iptc_dataset_set_data (clone->datasets[0],
+			(const unsigned char *) "new", 3, IPTC_DONT_VALIDATE);
+	iptc_data_unref (clone);
+	CHECK (destroyed == 1);
+
+	/* Lazy loading, with a dataset created before the collection
+	 * is released */
+	buf = new_buf ();
+	d = iptc_data_new ();
+	CHECK (iptc_data_load_lazy (d, buf, sizeof (stream),
+				destroy, buf) == 0);
+	ds = iptc_data_get_dataset (d, 2, 25);
+	iptc_data_unref (d);
+	CHECK (destroyed == 0);
+	CHECK (ds && ds->size == 2 && !memcmp (ds->data, "k1", 2));
+	iptc_dataset_unref (ds);
+	CHECK (destroyed == 1);
+
+	/* Skipped datasets kept for saving */
+	buf = new_buf ();
+	d = iptc_data_new ();
+	iptc_tag_filter_clear (&filter);
+	iptc_tag_filter_add (&filter, 2, 120);
+	CHECK (iptc_data_load_filtered (d, buf, sizeof (stream), &filter,
+				IPTC_LOAD_KEEP_SKIPPED, destroy, buf) == 0);
+	CHECK (destroyed == 0);
+	iptc_data_discard_skipped (d);
+	CHECK (destroyed == 1);
+	iptc_data_unref (d);
+
+	/* Nothing borrowed */
+	buf = new_buf ();
+	d = iptc_data_new ();
+	CHECK (iptc_data_load_filtered (d, buf, sizeof (stream), NULL, 0,
+				destroy, buf) == 0);
+	CHECK (destroyed == 1);
+	iptc_data_unref (d);
+
+	return test_failures ? 1 : 0;
+}
@@ -0,0 +1,61 @@
+/* test-common.c
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <libiptcdata/iptc-jpeg.h>
+
+#include "test-common.h"
+
+/* Enough image data after the headers for the JPEG functions, which
+ * expect the file to go on past the start of the scan */
+#define SMALL_SCAN	256
+
+int test_failures = 0;
+
+FILE *
+test_new_image (unsigned long scan_size)
+{
+	unsigned char scan[4096];
+	unsigned long n;
+	FILE *f = tmpfile ();
+
+	if (!f)
+		return NULL;
+	memset (scan, 0x55, sizeof (scan));
+	fwrite (jpeg_head, 1, sizeof (jpeg_head), f);
+	for (; scan_size; scan_size -= n) {
+		n = scan_size < sizeof (scan) ? scan_size : sizeof (scan);
+		fwrite (scan, 1, n, f);
+	}
+	if (fflush (f) != 0) {
+		fclose (f);
+		return NULL;
+	}
+	rewind (f);
+	return f;
+}
+
+FILE *
+test_save_image (const unsigned char *ps3, unsigned int ps3_size)
+{
+	FILE *in, *out;
+
+	in = test_new_image (SMALL_SCAN);
+	if (!in)
+		return NULL;
+	out = tmpfile ();
+	if (out && iptc_jpeg_save_with_ps3 (in, out, ps3, ps3_size) < 0) {
+		fclose (out);
+		out = NULL;
+	}
+	fclose (in);
+	if (out)
+		rewind (out);
+	return out;
+}
@@ -0,0 +1,46 @@
+/* test-common.h
+ *
+ * Checks and fixtures shared by the test programs.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ */
+
+#ifndef __TEST_COMMON_H__
+#define __TEST_COMMON_H__
+
+#include <stdio.h>
+
+/* Number of failed checks.  A test exits with 1 if there were any. */
+extern int test_failures;
+
+#define CHECK(cond) do {						\
+	if (!(cond)) {							\
+		fprintf (stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+		test_failures++;					\
+	}								\
+} while (0)
+
+/* SOI, a JFIF APP0 section, then the start of the image data */
+static const unsigned char jpeg_head[] = {
+	0xff, 0xd8,
+	0xff, 0xe0, 0x00, 0x10, 'J', 'F', 'I', 'F', 0x00,
+	0x01, 0x01, 0x00, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00,
+	0xff, 0xda, 0x00, 0x08, 0x01, 0x01, 0x00, 0x00, 0x3f, 0x00,
+};
+
+static const unsigned char caption[] = {
+	0x1c, 2, 120, 0, 5, 'h', 'e', 'l', 'l', 'o',
+};
+
+/* Writes jpeg_head followed by @scan_size bytes of image data to a
+ * temporary file, and returns it rewound, or NULL on error */
+FILE *test_new_image (unsigned long scan_size);
+
+/* Saves @ps3 in a new copy of a small image, and returns it rewound,
+ * or NULL on error */
+FILE *test_save_image (const unsigned char *ps3, unsigned int ps3_size);
+
+#endif /* __TEST_COMMON_H__ */
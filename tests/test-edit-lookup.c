@@ -0,0 +1,126 @@
+/* test-edit-lookup.c
+ *
+ * Searches on a batch of changes must see the datasets added through
+ * it in their final order, whatever their record:tag or how it
+ * changed since they were added.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <libiptcdata/iptc-data.h>
+
+#include "test-common.h"
+
+static IptcDataSet *
+new_dataset (IptcTag tag, char c)
+{
+	IptcDataSet *ds = iptc_dataset_new ();
+
+	iptc_dataset_set_tag (ds, 2, tag);
+	iptc_dataset_set_data (ds, (unsigned char *) &c, 1,
+			IPTC_DONT_VALIDATE);
+	return ds;
+}
+
+static void
+add (IptcData *data, IptcTag tag, char c)
+{
+	IptcDataSet *ds = new_dataset (tag, c);
+
+	iptc_data_add_dataset (data, ds);
+	iptc_dataset_unref (ds);
+}
+
+/* Values of the datasets with @tag, as seen through @edit */
+static const char *
+walk (IptcDataEdit *edit, IptcTag tag)
+{
+	static char buf[32];
+	IptcDataSet *ds, *next;
+	unsigned int n = 0;
+
+	for (ds = iptc_data_edit_get_next_dataset (edit, NULL, 2, tag); ds;
+			ds = next) {
+		if (n < sizeof (buf) - 1)
+			buf[n++] = ds->data[0];
+		next = iptc_data_edit_get_next_dataset (edit, ds, 2, tag);
+		iptc_dataset_unref (ds);
+	}
+	buf[n] = '\0';
+	return buf;
+}
+
+int
+main (void)
+{
+	IptcData *d;
+	IptcDataEdit *edit;
+	IptcDataSet *ds, *next, *x, *upper[3];
+	char order[16];
+	unsigned int i, n = 0;
+
+	d = iptc_data_new ();
+	add (d, 25, 'a');
+	add (d, 5, 'x');
+	add (d, 25, 'b');
+	add (d, 25, 'c');
+
+	edit = iptc_data_edit_begin (d);
+	CHECK (edit != NULL);
+	if (!edit)
+		return 1;
+
+	/* Continue each search from the dataset just added */
+	for (ds = iptc_data_edit_get_next_dataset (edit, NULL, 2, 25);
+			ds && n < 3; ds = next) {
+		x = upper[n++] = new_dataset (25, ds->data[0] - 'a' + 'A');
+		CHECK (iptc_data_edit_add_after (edit, ds, x) == 0);
+		iptc_dataset_unref (ds);
+		next = iptc_data_edit_get_next_dataset (edit, x, 2, 25);
+	}
+	CHECK (n == 3);
+	CHECK (strcmp (walk (edit, 25), "aAbBcC") == 0);
+
+	ds = iptc_data_edit_get_next_dataset (edit, upper[0], 2, 25);
+	x = new_dataset (25, 'm');
+	CHECK (iptc_data_edit_add_before (edit, ds, x) == 0);
+	iptc_dataset_unref (x);
+	iptc_dataset_unref (ds);
+	CHECK (strcmp (walk (edit, 25), "aAmbBcC") == 0);
+
+	CHECK (iptc_data_edit_remove (edit, upper[0]) == 0);
+	CHECK (strcmp (walk (edit, 25), "ambBcC") == 0);
+
+	/* Moving an added dataset to another record:tag */
+	iptc_dataset_set_tag (upper[1], 2, 120);
+	CHECK (strcmp (walk (edit, 25), "ambcC") == 0);
+	CHECK (strcmp (walk (edit, 120), "B") == 0);
+
+	/* A tag outside of the index */
+	x = new_dataset (300, 'z');
+	CHECK (iptc_data_edit_add (edit, x) == 0);
+	iptc_dataset_unref (x);
+	x = new_dataset (25, 'y');
+	CHECK (iptc_data_edit_add (edit, x) == 0);
+	iptc_dataset_unref (x);
+	CHECK (strcmp (walk (edit, 25), "ambcCy") == 0);
+	CHECK (strcmp (walk (edit, 300), "z") == 0);
+
+	for (i = 0; i < 3; i++)
+		iptc_dataset_unref (upper[i]);
+
+	CHECK (iptc_data_edit_commit (edit) == 0);
+	CHECK (d->count == 9);
+	for (i = 0; i < d->count && i < sizeof (order) - 1; i++)
+		order[i] = d->datasets[i]->data[0];
+	order[i] = '\0';
+	CHECK (strcmp (order, "axmbBcCzy") == 0);
+	iptc_data_unref (d);
+
+	return test_failures ? 1 : 0;
+}
@@ -0,0 +1,84 @@
+/* test-lazy-retag.c
+ *
+ * Changing the tag of a dataset from a lazily loaded collection must
+ * move it to its new record:tag, for lookups as well as when saving.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <libiptcdata/iptc-data.h>
+
+#include "test-common.h"
+
+static const unsigned char stream[] = {
+	0x1c, 2, 25, 0, 2, 'k', '1',
+	0x1c, 2, 25, 0, 2, 'k', '2',
+	0x1c, 2, 90, 0, 5, 'P', 'a', 'r', 'i', 's',
+};
+
+static int
+has_tag (IptcDataSet *ds, IptcRecord record, IptcTag tag)
+{
+	int ret = ds && ds->record == record && ds->tag == tag;
+	if (ds)
+		iptc_dataset_unref (ds);
+	return ret;
+}
+
+int
+main (void)
+{
+	IptcData *d, *copy;
+	IptcDataSet *ds, *next;
+	unsigned char *buf = NULL;
+	unsigned int size;
+
+	d = iptc_data_new ();
+	CHECK (d && iptc_data_load_lazy (d, stream, sizeof (stream),
+			NULL, NULL) == 0);
+	if (!d)
+		return 1;
+
+	/* Retag the first keyword as the caption */
+	ds = iptc_data_get_dataset (d, 2, 25);
+	CHECK (ds != NULL);
+	if (!ds)
+		return 1;
+	iptc_dataset_set_tag (ds, 2, 120);
+
+	CHECK (has_tag (iptc_data_get_dataset (d, 2, 120), 2, 120));
+	CHECK (iptc_data_get_next_dataset (d, ds, 2, 120) == NULL);
+	next = iptc_data_get_dataset (d, 2, 25);
+	CHECK (next != ds && has_tag (next, 2, 25));
+	iptc_dataset_unref (ds);
+
+	/* A tag too large for the lazy headers */
+	ds = iptc_data_get_dataset (d, 2, 90);
+	CHECK (ds != NULL);
+	if (ds) {
+		iptc_dataset_set_tag (ds, 2, 300);
+		CHECK (iptc_data_get_dataset (d, 2, 90) == NULL);
+		CHECK (has_tag (iptc_data_get_dataset (d, 2, 300), 2, 300));
+		iptc_dataset_set_tag (ds, 2, 90);
+		iptc_dataset_unref (ds);
+	}
+
+	/* Saving must use the new tag */
+	CHECK (iptc_data_save (d, &buf, &size) == 0);
+	copy = iptc_data_new_from_data (buf, size);
+	CHECK (copy && copy->count == 3);
+	if (copy && copy->count == 3) {
+		CHECK (copy->datasets[0]->tag == 120);
+		CHECK (copy->datasets[1]->tag == 25);
+		CHECK (copy->datasets[2]->tag == 90);
+	}
+	iptc_data_free_buf (d, buf);
+	iptc_data_unref (copy);
+	iptc_data_unref (d);
+
+	return test_failures ? 1 : 0;
+}
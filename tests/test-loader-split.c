@@ -0,0 +1,172 @@
+/* test-loader-split.c
+ *
+ * A Photoshop 3.0 header too large for one APP13 segment is split
+ * across several.  The loader must find the IPTC data wherever the
+ * split falls, as iptc_jpeg_read_ps3() does.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libiptcdata/iptc-jpeg.h>
+#include <libiptcdata/iptc-loader.h>
+#include <libiptcdata/iptc-mem.h>
+
+#include "test-common.h"
+
+/* Size of the data in the first segment, where splits happen */
+#define SEGMENT_DATA	65533
+
+/* Makes a Photoshop header with a resource of @skip bytes, followed
+ * by the IPTC data if @with_iptc is set */
+static unsigned int
+make_ps3 (unsigned char *ps3, unsigned int skip, int with_iptc)
+{
+	unsigned int j = 14;
+
+	memcpy (ps3, "Photoshop 3.0", 14);
+	memcpy (ps3 + j, "8BIM\x04\x09\0\0", 8);
+	ps3[j+8] = skip >> 24;
+	ps3[j+9] = skip >> 16;
+	ps3[j+10] = skip >> 8;
+	ps3[j+11] = skip;
+	j += 12;
+	memset (ps3 + j, 0x77, skip + (skip & 1));
+	j += skip + (skip & 1);
+	if (with_iptc) {
+		memcpy (ps3 + j, "8BIM\x04\x04\0\0\0\0\0", 11);
+		ps3[j+11] = sizeof (caption);
+		j += 12;
+		memcpy (ps3 + j, caption, sizeof (caption));
+		j += sizeof (caption);
+	}
+	return j;
+}
+
+/* Saves @ps3 in a JPEG file, and returns its contents */
+static unsigned char *
+make_jpeg (const unsigned char *ps3, unsigned int ps3_size, long *len)
+{
+	unsigned char *buf;
+	FILE *f;
+
+	f = test_save_image (ps3, ps3_size);
+	if (!f)
+		return NULL;
+	fseek (f, 0, SEEK_END);
+	*len = ftell (f);
+	rewind (f);
+	buf = malloc (*len);
+	if (buf && fread (buf, 1, *len, f) != (size_t) *len) {
+		free (buf);
+		buf = NULL;
+	}
+	fclose (f);
+	return buf;
+}
+
+/* A header claiming an IPTC resource of almost 4 GB */
+static const unsigned char huge[] = {
+	0xff, 0xd8,
+	0xff, 0xed, 0x00, 0x1c,
+	'P', 'h', 'o', 't', 'o', 's', 'h', 'o', 'p', ' ', '3', '.', '0', 0,
+	'8', 'B', 'I', 'M', 0x04, 0x04, 0, 0, 0xff, 0xff, 0xff, 0xf0,
+};
+
+/* Largest request made to the allocator */
+static IptcLong largest = 0;
+
+static void *
+count_alloc (IptcLong size)
+{
+	if (size > largest)
+		largest = size;
+	return calloc ((size_t) size, 1);
+}
+
+static void *
+count_realloc (void *p, IptcLong size)
+{
+	if (size > largest)
+		largest = size;
+	return realloc (p, (size_t) size);
+}
+
+/* Feeds @jpeg to @loader in pieces of @chunk bytes */
+static IptcLoaderStatus
+feed (IptcLoader *loader, const unsigned char *jpeg, long len, long chunk)
+{
+	IptcLoaderStatus status = IPTC_LOADER_NEED_MORE;
+	long i;
+
+	iptc_loader_reset (loader);
+	for (i = 0; i < len && status == IPTC_LOADER_NEED_MORE; i += chunk)
+		status = iptc_loader_write (loader, jpeg + i,
+				len - i < chunk ? len - i : chunk);
+	return status;
+}
+
+int
+main (void)
+{
+	static unsigned char ps3[2 * SEGMENT_DATA];
+	IptcLoader *loader = iptc_loader_new ();
+	IptcMem *mem;
+	const unsigned char *iptc;
+	unsigned char *jpeg;
+	unsigned int ps3_size, size, skip;
+	long len;
+	int with_iptc;
+
+	CHECK (loader != NULL);
+	if (!loader)
+		return 1;
+
+	/* Move the split through the end of the first resource, the
+	 * header of the IPTC resource and its data */
+	for (skip = SEGMENT_DATA - 60; skip <= SEGMENT_DATA - 20; skip++) {
+		for (with_iptc = 0; with_iptc <= 1; with_iptc++) {
+			ps3_size = make_ps3 (ps3, skip, with_iptc);
+			jpeg = make_jpeg (ps3, ps3_size, &len);
+			CHECK (jpeg != NULL);
+			if (!jpeg)
+				continue;
+
+			if (!with_iptc) {
+				CHECK (feed (loader, jpeg, len, 4096) ==
+						IPTC_LOADER_NOT_FOUND);
+				free (jpeg);
+				continue;
+			}
+
+			CHECK (feed (loader, jpeg, len, 1) == IPTC_LOADER_DONE);
+			CHECK (feed (loader, jpeg, len, 4096) ==
+					IPTC_LOADER_DONE);
+			iptc = iptc_loader_get_buf (loader, &size);
+			CHECK (iptc && size == sizeof (caption) &&
+					!memcmp (iptc, caption, size));
+			free (jpeg);
+		}
+	}
+
+	iptc_loader_unref (loader);
+
+	/* Nothing may be allocated for data that has not arrived */
+	mem = iptc_mem_new (count_alloc, count_realloc, free);
+	loader = iptc_loader_new_mem (mem);
+	iptc_mem_unref (mem);
+	CHECK (loader != NULL);
+	if (!loader)
+		return 1;
+	CHECK (feed (loader, huge, sizeof (huge), sizeof (huge)) !=
+			IPTC_LOADER_DONE);
+	CHECK (largest < 65536);
+	iptc_loader_unref (loader);
+
+	return test_failures ? 1 : 0;
+}
@@ -0,0 +1,97 @@
+/* test-padding.c
+ *
+ * Padding reserved with an odd number of bytes, or left over by an
+ * in-place update, must not keep the Photoshop header from being
+ * parsed and saved again.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <libiptcdata/iptc-jpeg.h>
+
+#include "test-common.h"
+
+static const unsigned char keywords[] = {
+	0x1c, 2, 25, 0, 2, 'k', '1',
+	0x1c, 2, 25, 0, 2, 'k', '2',
+};
+
+/* Reads the header of @f back, and checks that new IPTC data can be
+ * saved in it */
+static int
+read_and_resave (FILE *f, unsigned char *ps3, unsigned int size)
+{
+	unsigned char buf[1024];
+	unsigned int iptc_len;
+	int len;
+
+	rewind (f);
+	len = iptc_jpeg_read_ps3 (f, ps3, size);
+	if (len <= 0)
+		return -1;
+	if (iptc_jpeg_ps3_find_iptc (ps3, len, &iptc_len) <= 0)
+		return -1;
+	if (iptc_jpeg_ps3_save_iptc (ps3, len, keywords, sizeof (keywords),
+				buf, sizeof (buf)) < 0)
+		return -1;
+	return len;
+}
+
+int
+main (void)
+{
+	unsigned char ps3[1024], small[1024], back[1024];
+	int len, small_len, i;
+	FILE *f;
+
+	small_len = iptc_jpeg_ps3_save_iptc (NULL, 0, caption,
+			sizeof (caption), small, sizeof (small));
+	CHECK (small_len > 0 && (small_len & 1) == 0);
+
+	/* Odd reserves are rounded up to an even size */
+	for (i = 12; i <= 15; i++) {
+		memcpy (ps3, small, small_len);
+		len = iptc_jpeg_ps3_add_padding (ps3, small_len,
+				sizeof (ps3), i);
+		CHECK (len == small_len + i + (i & 1));
+		f = test_save_image (ps3, len);
+		CHECK (f != NULL);
+		if (f) {
+			CHECK (read_and_resave (f, back, sizeof (back)) == len);
+			fclose (f);
+		}
+	}
+	CHECK (iptc_jpeg_ps3_add_padding (ps3, small_len, sizeof (ps3), 11) < 0);
+
+	/* An even remainder is filled with padding in place */
+	memcpy (ps3, small, small_len);
+	len = iptc_jpeg_ps3_add_padding (ps3, small_len, sizeof (ps3), 40);
+	f = test_save_image (ps3, len);
+	CHECK (f != NULL);
+	if (f) {
+		CHECK (iptc_jpeg_update_in_place (f, small, small_len) == 1);
+		CHECK (read_and_resave (f, back, sizeof (back)) == len);
+		fclose (f);
+	}
+
+	/* An odd remainder cannot be, so the file is left alone */
+	memcpy (ps3, small, small_len);
+	memset (ps3 + small_len, 0, 13);
+	f = test_save_image (ps3, small_len + 13);
+	CHECK (f != NULL);
+	if (f) {
+		CHECK (iptc_jpeg_update_in_place (f, small, small_len) == 0);
+		rewind (f);
+		CHECK (iptc_jpeg_read_ps3 (f, back, sizeof (back)) ==
+				small_len + 13);
+		CHECK (memcmp (back, ps3, small_len + 13) == 0);
+		fclose (f);
+	}
+
+	return test_failures ? 1 : 0;
+}